@@ -1,15 +1,50 @@
 import os
 import psycopg2
+from psycopg2.extras import execute_values
+from psycopg2.pool import ThreadedConnectionPool
+from contextlib import contextmanager
 import json
+import zlib
+import threading
+import random
+from time import monotonic
+import cbor2
 from dotenv import load_dotenv
-from flask import Flask, request
+from flask import Flask, request, abort
 from datetime import datetime, timezone, timedelta
 
 load_dotenv()
 
 app = Flask(__name__)
+
+#Caps on an upload: MAX_UPLOAD_BYTES as sent (Flask answers 413 past it) and
+#MAX_DECOMPRESSED_BYTES once a gzip or deflate body is inflated, so a small
+#compressed body cannot expand without bound
+MAX_UPLOAD_BYTES = int(os.environ.get("MAX_UPLOAD_BYTES", 64 * 1024 * 1024))
+MAX_DECOMPRESSED_BYTES = int(os.environ.get("MAX_DECOMPRESSED_BYTES", 256 * 1024 * 1024))
+app.config["MAX_CONTENT_LENGTH"] = MAX_UPLOAD_BYTES
 url = os.environ.get("DATABASE_URL")
-connection = psycopg2.connect(url)
+
+#Every request (or long-poll lookup) runs its transactions on a connection of
+#its own from the pool, so one thread's commit or rollback never ends another
+#thread's transaction. Past DB_POOL_CONNECTIONS concurrent transactions,
+#requests wait for a connection to come back.
+DB_POOL_CONNECTIONS = int(os.environ.get("DB_POOL_CONNECTIONS", 20))
+pool = ThreadedConnectionPool(1, DB_POOL_CONNECTIONS, url)
+pool_slots = threading.BoundedSemaphore(DB_POOL_CONNECTIONS)
+
+
+@contextmanager
+def transaction():
+    # A pooled connection for one transaction: committed when the block
+    # finishes, rolled back if it raises, then handed back to the pool
+    with pool_slots:
+        conn = pool.getconn()
+        try:
+            with conn:
+                yield conn
+        finally:
+            pool.putconn(conn)
 
 
 #CONSTS
@@ -27,7 +62,43 @@ INSERT_BEACON = (
 
 
 
-CREATE_PENDING_TASKS_TABLE = """CREATE TABLE IF NOT EXISTS pending_tasks (task_id SERIAL PRIMARY KEY, agent_id INT REFERENCES agents(id) ON DELETE CASCADE, command TEXT NOT NULL, created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"""
+CREATE_PENDING_TASKS_TABLE = """CREATE TABLE IF NOT EXISTS pending_tasks (task_id SERIAL PRIMARY KEY, agent_id INT REFERENCES agents(id) ON DELETE CASCADE, command TEXT NOT NULL, created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP, leased_until TIMESTAMP);"""
+ADD_TASK_LEASE_COLUMN = """ALTER TABLE pending_tasks ADD COLUMN IF NOT EXISTS leased_until TIMESTAMP;"""
+
+#A task handed to an agent is leased to it so later polls skip it while it
+#runs; if no result arrives before the lease runs out it is handed out again
+TASK_LEASE_SECONDS = 600
+LEASE_PENDING_TASKS_BY_AGENT = """UPDATE pending_tasks SET leased_until = CURRENT_TIMESTAMP + %s * INTERVAL '1 second' WHERE agent_id = %s AND (leased_until IS NULL OR leased_until < CURRENT_TIMESTAMP) RETURNING task_id, agent_id, command, created_at;"""
+RELEASE_TASK_LEASES = """UPDATE pending_tasks SET leased_until = NULL WHERE task_id = ANY(%s);"""
+
+#Long polling: a poll that asks to "wait" is held until a task for the agent
+#is added or the wait runs out (at most LONG_POLL_MAX_SECONDS while an
+#operator is at work, CHECKIN_IDLE_SECONDS otherwise). add_task wakes the
+#polls held by this process; a task added through another process is seen
+#within LONG_POLL_RECHECK_SECONDS.
+LONG_POLL_MAX_SECONDS = 30
+LONG_POLL_RECHECK_SECONDS = 1
+task_added = threading.Condition()
+task_generation = 0
+
+#Check-in pacing: every check-in reply suggests when to come back
+#("next_checkin", in seconds). Agents check in every CHECKIN_ACTIVE_SECONDS
+#while an operator is at work (added a task or read results in the last
+#OPERATOR_ACTIVE_SECONDS) and every CHECKIN_IDLE_SECONDS otherwise. Idle
+#agents are long-polled too, but held for up to the idle interval, so they
+#still check in that rarely and a new task reaches them at once. When more
+#than CHECKIN_RATE_LIMIT check-ins arrive within a second the server sheds
+#load: it stops holding long polls and spreads agents over a longer,
+#jittered interval, up to CHECKIN_MAX_SECONDS.
+CHECKIN_ACTIVE_SECONDS = 5
+CHECKIN_IDLE_SECONDS = 60
+CHECKIN_MAX_SECONDS = 600
+OPERATOR_ACTIVE_SECONDS = 300
+CHECKIN_RATE_LIMIT = 50
+checkin_pacing = threading.Lock()
+checkin_window_start = 0.0
+checkin_window_count = 0
+last_operator_activity = None
 
 #CREATE_COMPLETED_TASKS_TABLE = """CREATE TABLE IF NOT EXISTS completed_tasks (task_id INT PRIMARY KEY REFERENCES pending_tasks(task_id), agent_id INT REFERENCES agents(id), command TEXT, result TEXT, completion_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"""
 
@@ -42,14 +113,276 @@ INSERT INTO completed_tasks (task_id, agent_id, command, result) VALUES (%s, %s,
 DELETE FROM pending_tasks WHERE task_id = %s;
 """
 
+#Snapshot results (see SNAPSHOT_COMMANDS) are stored as sent, a delta as
+#just its changes, with the mode, seq and base_seq needed to rebuild the
+#full view when it is read. result_snapshots only remembers which seq each
+#agent's next delta must be based on and how many deltas follow its last
+#keyframe. Past SNAPSHOT_MAX_DELTAS a delta is refused, so the agent sends a
+#keyframe and rebuilding any stored result replays at most that many deltas.
+SNAPSHOT_MAX_DELTAS = 16
+CREATE_RESULT_SNAPSHOTS_TABLE = """CREATE TABLE IF NOT EXISTS result_snapshots (agent_id INT REFERENCES agents(id) ON DELETE CASCADE, command TEXT, seq INT, deltas INT NOT NULL DEFAULT 0, PRIMARY KEY (agent_id, command));"""
+ADD_COMPLETED_TASK_SNAPSHOT_COLUMNS = """ALTER TABLE completed_tasks ADD COLUMN IF NOT EXISTS mode TEXT, ADD COLUMN IF NOT EXISTS seq INT, ADD COLUMN IF NOT EXISTS base_seq INT;"""
+ADD_RESULT_SNAPSHOT_DELTAS_COLUMN = """ALTER TABLE result_snapshots ADD COLUMN IF NOT EXISTS deltas INT NOT NULL DEFAULT 0;"""
+#Earlier versions kept each agent's full view in result_snapshots.snapshot
+DROP_RESULT_SNAPSHOT_VIEWS = """ALTER TABLE result_snapshots DROP COLUMN IF EXISTS snapshot;"""
+GET_RESULT_SNAPSHOT_SEQ = """SELECT seq, deltas FROM result_snapshots WHERE agent_id = %s AND command = %s;"""
+UPSERT_RESULT_SNAPSHOT_SEQ = """INSERT INTO result_snapshots (agent_id, command, seq, deltas) VALUES (%s, %s, %s, %s) ON CONFLICT (agent_id, command) DO UPDATE SET seq = EXCLUDED.seq, deltas = EXCLUDED.deltas;"""
+
+INSERT_COMPLETED_TASKS = """INSERT INTO completed_tasks (task_id, agent_id, command, result, mode, seq, base_seq) VALUES %s;"""
+#Results are stored only for tasks still pending, so an upload the agent
+#sends twice (it retries when a reply is lost) is stored once
+LOCK_PENDING_TASKS = """SELECT task_id FROM pending_tasks WHERE task_id = ANY(%s) FOR UPDATE;"""
+DELETE_PENDING_TASKS = """DELETE FROM pending_tasks WHERE task_id = ANY(%s) RETURNING task_id;"""
+
 LIST_AGENTS = """SELECT * FROM agents"""
 LIST_BEACONS = """SELECT * FROM beacons"""
 LIST_PENDING_TASKS = """SELECT * FROM pending_tasks"""
-LIST_COMPLETED_TASKS = """SELECT * FROM completed_tasks"""
+LIST_COMPLETED_TASKS = """SELECT guid, task_id, agent_id, command, result, completion_time, mode, seq, base_seq FROM completed_tasks ORDER BY completion_time, seq;"""
 LIST_BEACON_BY_AGENT = """SELECT agents.id, agents.ip, agents.mac, agents.installTime, beacons.time FROM agents LEFT JOIN beacons ON agents.id = beacons.agent_id WHERE agents.id = (%s);"""
 LIST_PENDING_TASKS_BY_AGENT = """SELECT * FROM pending_tasks WHERE agent_id = (%s);"""
 
 
+def migrate_task_leases():
+    # Run once at startup, not per poll: ADD COLUMN takes an ACCESS EXCLUSIVE
+    # lock on pending_tasks even when the column is already there
+    with transaction() as connection:
+        with connection.cursor() as cursor:
+            cursor.execute(CREATE_AGENTS_TABLE)
+            cursor.execute(CREATE_PENDING_TASKS_TABLE)
+            cursor.execute(ADD_TASK_LEASE_COLUMN)
+
+
+migrate_task_leases()
+
+
+def lease_pending_tasks(cursor, agent_id):
+    # Pending tasks for the agent that nobody holds a lease on, leased to it
+    cursor.execute(LEASE_PENDING_TASKS_BY_AGENT, (TASK_LEASE_SECONDS, agent_id))
+    return cursor.fetchall()
+
+
+def wait_for_tasks(agent_id, wait):
+    # Leases the agent's pending tasks, holding the poll for up to wait
+    # seconds while there are none. Each lookup takes a pooled connection for
+    # its own transaction and returns it, so nothing is held while waiting.
+    deadline = monotonic() + min(max(wait, 0), long_poll_limit())
+    while True:
+        with task_added:
+            seen = task_generation
+        with transaction() as connection:
+            with connection.cursor() as cursor:
+                tasks = lease_pending_tasks(cursor, agent_id)
+        remaining = deadline - monotonic()
+        if tasks or remaining <= 0:
+            return tasks
+        with task_added:
+            if task_generation == seen:
+                task_added.wait(min(remaining, LONG_POLL_RECHECK_SECONDS))
+
+
+def notify_task_added():
+    global task_generation
+    with task_added:
+        task_generation += 1
+        task_added.notify_all()
+
+
+def note_operator_activity():
+    global last_operator_activity
+    last_operator_activity = monotonic()
+
+
+def checkin_load():
+    # Check-ins so far in the current one second window, relative to
+    # CHECKIN_RATE_LIMIT; above 1 means overloaded
+    global checkin_window_start, checkin_window_count
+    now = monotonic()
+    with checkin_pacing:
+        if now - checkin_window_start >= 1:
+            checkin_window_start = now
+            checkin_window_count = 0
+        checkin_window_count += 1
+        return checkin_window_count / CHECKIN_RATE_LIMIT
+
+
+def operator_active():
+    return last_operator_activity is not None and monotonic() - last_operator_activity < OPERATOR_ACTIVE_SECONDS
+
+
+def long_poll_limit():
+    return LONG_POLL_MAX_SECONDS if operator_active() else CHECKIN_IDLE_SECONDS
+
+
+def next_checkin_seconds(load):
+    interval = CHECKIN_ACTIVE_SECONDS if operator_active() else CHECKIN_IDLE_SECONDS
+    if load > 1:
+        # Stretch with the overload, then spread agents that arrived
+        # together over up to half as long again
+        interval = min(interval * load, CHECKIN_MAX_SECONDS)
+        interval += random.uniform(0, interval / 2)
+    return int(interval)
+
+
+def checkin_reply(agent_id, wait):
+    # Tasks leased to the agent plus pacing hints, long-polling when the
+    # agent asked to wait and the server is not shedding load
+    load = checkin_load()
+    if wait is not None and load <= 1:
+        return {"Tasks": wait_for_tasks(agent_id, wait), "long_poll": True, "next_checkin": next_checkin_seconds(load)}
+    with transaction() as connection:
+        with connection.cursor() as cursor:
+            tasks = lease_pending_tasks(cursor, agent_id)
+    return {"Tasks": tasks, "next_checkin": next_checkin_seconds(load)}
+
+
+def get_request_body():
+    # Large uploads arrive with Content-Encoding: gzip (or deflate); wbits
+    # 32 + MAX_WBITS lets zlib detect either wrapper. Inflating stops at
+    # MAX_DECOMPRESSED_BYTES; a body with more to give is refused with 413.
+    body = request.get_data()
+    if request.headers.get("Content-Encoding", "").lower() in ("gzip", "deflate"):
+        inflater = zlib.decompressobj(32 + zlib.MAX_WBITS)
+        try:
+            body = inflater.decompress(body, MAX_DECOMPRESSED_BYTES)
+        except zlib.error:
+            abort(400)
+        if inflater.unconsumed_tail or inflater.unused_data:
+            abort(413)
+        if not inflater.eof:
+            abort(400)  # truncated
+    return body
+
+
+def get_result_payload():
+    # Agents upload results as JSON or, with Content-Type: application/cbor,
+    # as the CBOR encoding of the same document
+    if request.mimetype == "application/cbor":
+        return cbor2.loads(get_request_body())
+    if request.mimetype == "application/json":
+        return json.loads(get_request_body())
+    return request.get_json()
+
+
+#SNAPSHOTS
+#Commands the agent can send as a full keyframe or a delta against its last
+#upload: how a row is keyed, which delta lists add/replace rows and which
+#remove them.
+SNAPSHOT_COMMANDS = {
+    "process_list": {
+        "key": lambda row: f"{row['PID']}:{row['Start']}",
+        "upsert": ("added", "renamed"),
+        "remove": ("exited",),
+    },
+    "netstat": {
+        "key": lambda row: f"{row['Proto']}|{row['Local']}|{row['Remote']}|{row['Inode']}",
+        "upsert": ("opened", "changed"),
+        "remove": ("closed",),
+    },
+}
+
+
+#Columnar results carry one array per column instead of a list of row
+#objects; low-cardinality columns come as {"dict": [...], "codes": [...]}.
+#Column name -> row field, so they can be turned back into rows.
+COLUMNAR_FIELDS = {
+    "process_list": {"pid": "PID", "start": "Start", "name": "Name"},
+    "netstat": {"proto": "Proto", "local": "Local", "remote": "Remote", "state": "State", "inode": "Inode"},
+}
+
+
+def rows_from_columns(command, columns):
+    fields = COLUMNAR_FIELDS[command]
+    decoded = {}
+    for name, column in columns.items():
+        if isinstance(column, dict):
+            dictionary = column["dict"]
+            column = [dictionary[code] for code in column["codes"]]
+        decoded[fields.get(name, name)] = column
+    count = len(next(iter(decoded.values()), []))
+    return [{field: values[i] for field, values in decoded.items()} for i in range(count)]
+
+
+def normalize_layout(result):
+    # Turns a columnar result (full or delta) back into row objects in place
+    if result.pop("layout", None) != "columnar":
+        return
+    command = result["command"]
+    if result.get("mode") == "delta":
+        for name, columns in result["results"].items():
+            result["results"][name] = rows_from_columns(command, columns)
+    else:
+        result["results"] = rows_from_columns(command, result["results"])
+
+
+def migrate_snapshot_columns():
+    # Run once at startup, like migrate_task_leases
+    with transaction() as connection:
+        with connection.cursor() as cursor:
+            cursor.execute(CREATE_AGENTS_TABLE)
+            cursor.execute(CREATE_COMPLETED_TASKS_TABLE)
+            cursor.execute(ADD_COMPLETED_TASK_SNAPSHOT_COLUMNS)
+            cursor.execute(CREATE_RESULT_SNAPSHOTS_TABLE)
+            cursor.execute(ADD_RESULT_SNAPSHOT_DELTAS_COLUMN)
+            cursor.execute(DROP_RESULT_SNAPSHOT_VIEWS)
+
+
+migrate_snapshot_columns()
+
+
+def stored_result(cursor, agent_id, result):
+    # The (result, mode, seq, base_seq) columns a result is stored with. A
+    # delta is kept as the changes it carries, so storing it costs what the
+    # agent sent rather than the size of the host. None when the delta was
+    # taken against a snapshot we don't hold, or would make the chain since
+    # the last keyframe longer than SNAPSHOT_MAX_DELTAS.
+    command = result["command"]
+    mode = result.get("mode")
+    if command not in SNAPSHOT_COMMANDS or mode is None:
+        return ''.join(str(r) for r in result["results"]), None, None, None
+
+    deltas = 0
+    if mode != "full":
+        cursor.execute(GET_RESULT_SNAPSHOT_SEQ, (agent_id, command))
+        stored = cursor.fetchone()
+        if stored is None or stored[0] != result["base_seq"] or stored[1] >= SNAPSHOT_MAX_DELTAS:
+            return None
+        deltas = stored[1] + 1
+    cursor.execute(UPSERT_RESULT_SNAPSHOT_SEQ, (agent_id, command, result["seq"], deltas))
+    return json.dumps(result["results"]), mode, result["seq"], result.get("base_seq")
+
+
+def rebuild_results(tasks):
+    # Replaces every stored snapshot result with its full row list, replaying
+    # each agent's keyframes and deltas in the order they were stored; a
+    # delta is at most SNAPSHOT_MAX_DELTAS away from its keyframe. Takes
+    # and returns LIST_COMPLETED_TASKS rows, the latter without the snapshot
+    # columns.
+    views = {}
+    rebuilt = []
+    for guid, task_id, agent_id, command, result, completion_time, mode, seq, base_seq in tasks:
+        if mode is not None:
+            spec = SNAPSHOT_COMMANDS[command]
+            changes = json.loads(result)
+            view = views.get((agent_id, command))
+            if mode == "full":
+                view = {"seq": seq, "rows": {spec["key"](row): row for row in changes}}
+            elif view is not None and view["seq"] == base_seq:
+                for name in spec["remove"]:
+                    for row in changes[name]:
+                        view["rows"].pop(spec["key"](row), None)
+                for name in spec["upsert"]:
+                    for row in changes[name]:
+                        view["rows"][spec["key"](row)] = row
+                view["seq"] = seq
+            else:
+                view = None  # its base is gone; left as the changes it carried
+            views[(agent_id, command)] = view
+            if view is not None:
+                result = ''.join(str(r) for r in view["rows"].values())
+        rebuilt.append((guid, task_id, agent_id, command, result, completion_time))
+    return rebuilt
+
+
 #POSTS BELOW
 
 @app.post("/api/new_agent")
@@ -63,7 +396,7 @@ def create_agent():
         time = datetime.strptime(data["time"], "%m-%d-%Y %H:%M:%S")
     except KeyError:
         time = datetime.now(timezone.utc)
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(CREATE_AGENTS_TABLE)
             cursor.execute(INSERT_AGENT_RETURN_ID, (ip, mac, time))
@@ -79,28 +412,47 @@ def add_temp():
         time = datetime.strptime(data["time"], "%m-%d-%Y %H:%M:%S")
     except KeyError:
         time = datetime.now(timezone.utc)
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(CREATE_BEACONS_TABLE)
             cursor.execute(INSERT_BEACON, (agent_id, time))
     return {"message": "Beacon added."}, 201
 
 
+@app.post("/api/agent/checkin")
+def agent_checkin():
+    # Beacon + pending task fetch in one round trip
+    data = request.get_json()
+    agent_id = data["agent_id"]
+    try:
+        time = datetime.strptime(data["time"], "%m-%d-%Y %H:%M:%S")
+    except KeyError:
+        time = datetime.now(timezone.utc)
+    wait = data.get("wait")
+    with transaction() as connection:
+        with connection.cursor() as cursor:
+            cursor.execute(CREATE_BEACONS_TABLE)
+            cursor.execute(INSERT_BEACON, (agent_id, time))
+    return checkin_reply(agent_id, None if wait is None else float(wait))
+
+
 @app.post("/api/add_task")
 def add_task():
     data = request.get_json()
     agent_id = data["agent_id"]
     command = data["command"]
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(CREATE_PENDING_TASKS_TABLE)
             cursor.execute(INSERT_TASK, (agent_id, command))
             task_id = cursor.fetchone()[0]
+    note_operator_activity()
+    notify_task_added()
     return {"Task ID": task_id}, 201
 
 @app.post("/api/agent/task/send_result")
 def send_result():
-    data = request.get_json()
+    data = get_result_payload()
     agent_id = data["agent_id"]
     task_id = data["task_id"]
     command = data["command"]
@@ -108,19 +460,66 @@ def send_result():
     print(type(command))
     new_results = ''.join(str(result) for result in results)
     print(f"task_id: {task_id}, agent_id: {agent_id}, command: {command}, new_results: {new_results}")
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(CREATE_COMPLETED_TASKS_TABLE)
             cursor.execute(INSERT_COMPLETED_TASK, (task_id, agent_id, command, new_results, task_id))
     return {"message": "done"}, 201
 
 
+@app.post("/api/agent/task/send_results")
+def send_results():
+    # Every result from one agent poll cycle, stored in a single transaction.
+    # A delta that can't be applied leaves its task pending, with its lease
+    # released, and is reported back in "resync" so the agent re-runs it as
+    # a full keyframe. "stored" acknowledges the tasks that are done,
+    # including ones an earlier copy of the same upload already stored.
+    data = get_result_payload()
+    rows = []
+    resync = []
+    released = []
+    duplicates = []
+    with transaction() as connection:
+        with connection.cursor() as cursor:
+            cursor.execute(CREATE_COMPLETED_TASKS_TABLE)
+            cursor.execute(CREATE_RESULT_SNAPSHOTS_TABLE)
+            # Locked until commit, so a concurrent copy of this upload waits
+            # and then finds the tasks gone
+            cursor.execute(LOCK_PENDING_TASKS, ([result["task_id"] for result in data],))
+            pending = {row[0] for row in cursor.fetchall()}
+            for result in data:
+                if result["task_id"] not in pending:
+                    duplicates.append(result["task_id"])
+                    continue
+                pending.discard(result["task_id"])
+                normalize_layout(result)
+                stored = stored_result(cursor, result["agent_id"], result)
+                if stored is None:
+                    resync.append(result["command"])
+                    released.append(result["task_id"])
+                    continue
+                rows.append((result["task_id"], result["agent_id"], result["command"]) + stored)
+            task_ids = []
+            if rows:
+                cursor.execute(DELETE_PENDING_TASKS, ([row[0] for row in rows],))
+                task_ids = [row[0] for row in cursor.fetchall()]
+                deleted = set(task_ids)
+                rows = [row for row in rows if row[0] in deleted]
+            print(f"agent results for tasks: {task_ids}, resync: {resync}, already stored: {duplicates}")
+            if rows:
+                execute_values(cursor, INSERT_COMPLETED_TASKS, rows)
+            if released:
+                cursor.execute(RELEASE_TASK_LEASES, (released,))
+    return {"message": "done", "count": len(rows), "deltas": True, "columnar": True, "gzip": True,
+            "resync": resync, "stored": task_ids + duplicates}, 201
+
+
 #GETS BELOW
 
 
 @app.get("/api/list_agents")
 def list_agents():
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(LIST_AGENTS)
             agents = cursor.fetchall()
@@ -128,7 +527,7 @@ def list_agents():
 
 @app.get("/api/list_beacons")
 def list_beacons():
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(LIST_BEACONS)
             agents = cursor.fetchall()
@@ -136,7 +535,7 @@ def list_beacons():
 
 @app.get("/api/list_tasks")
 def list_tasks():
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(LIST_PENDING_TASKS)
             tasks = cursor.fetchall()
@@ -145,15 +544,16 @@ def list_tasks():
 
 @app.get("/api/list_completed_tasks")
 def list_completed_tasks():
-    with connection:
+    note_operator_activity()
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(LIST_COMPLETED_TASKS)
-            tasks = cursor.fetchall()
+            tasks = rebuild_results(cursor.fetchall())
     return {"Tasks": tasks}
 
 @app.get("/api/agent/beacons/<int:agent_id>")
 def agent_beacons(agent_id):
-    with connection:
+    with transaction() as connection:
         with connection.cursor() as cursor:
             cursor.execute(LIST_BEACON_BY_AGENT, (agent_id,))
             beacons = cursor.fetchall()
@@ -161,8 +561,4 @@ def agent_beacons(agent_id):
 
 @app.get("/api/agent/tasks/pending/<int:agent_id>")
 def agent_pending_tasks(agent_id):
-    with connection:
-        with connection.cursor() as cursor:
-            cursor.execute(LIST_PENDING_TASKS_BY_AGENT, (agent_id,))
-            tasks = cursor.fetchall()
-    return {"Tasks": tasks}
+    return checkin_reply(agent_id, request.args.get("wait", type=float))
@@ -0,0 +1,649 @@
+/*
+Microbenchmarks for the agent's collectors and codecs.
+
+    client_bench [filter]
+
+Runs every benchmark whose name contains filter and prints ns/op plus the
+allocations and bytes requested from operator new per op; the codecs also
+print the bytes they encode per op (out B/op). Benchmarks
+marked (live) read this host's /proc and sockets; the rest run on fixtures
+generated here from a fixed seed. Uploads go to a loopback stub server,
+optionally read at a capped rate to stand in for a slow link.
+*/
+
+#define EZC2_NO_MAIN
+#include "client.cpp"
+#include "fixtures.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+using namespace std;
+
+/*
+ALLOCATION COUNTING
+*/
+
+static atomic<uint64_t> allocation_count{0};
+static atomic<uint64_t> allocation_bytes{0};
+
+/*
+Every replaceable form of operator new goes through here, so aligned and
+nothrow allocations are counted too, and every form of operator delete
+frees with free(), which takes both malloc and aligned_alloc pointers.
+*/
+static void* counted_allocation(size_t size, size_t alignment = 0) {
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    allocation_bytes.fetch_add(size, memory_order_relaxed);
+    if (size == 0) size = 1;
+    if (alignment <= alignof(max_align_t)) return malloc(size);
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+// Out of line so GCC does not pair an inlined free() with a new-expression
+// and warn (-Wmismatched-new-delete); here the two match by construction.
+__attribute__((noinline)) static void release(void* p) noexcept { free(p); }
+
+static void* counted_allocation_or_throw(size_t size, size_t alignment = 0) {
+    if (void* p = counted_allocation(size, alignment)) return p;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size) { return counted_allocation_or_throw(size); }
+void* operator new[](size_t size) { return counted_allocation_or_throw(size); }
+void* operator new(size_t size, align_val_t alignment) {
+    return counted_allocation_or_throw(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, align_val_t alignment) {
+    return counted_allocation_or_throw(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, const nothrow_t&) noexcept { return counted_allocation(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return counted_allocation(size); }
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return counted_allocation(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    return counted_allocation(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, align_val_t) noexcept { release(p); }
+void operator delete[](void* p, align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { release(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { release(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept { release(p); }
+
+/*
+END ALLOCATION COUNTING
+*/
+
+
+
+/*
+BENCHMARK RUNNER
+*/
+
+const char* bench_filter = "";
+// Bytes a benchmark produced, such as encoded output; reported per op when set.
+static atomic<uint64_t> output_bytes{0};
+double bench_seconds = 0.3;
+
+template <typename Fn>
+static double time_calls(Fn& fn, uint64_t calls) {
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < calls; i++) fn();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/*
+Calls fn until about bench_seconds have passed and prints the cost per op,
+where one call of fn is ops_per_call ops (rows of a table, say). The call
+count is found by doubling from one after a warm-up call.
+*/
+template <typename Fn>
+static void measure(const string& name, Fn&& fn, double ops_per_call = 1) {
+    if (name.find(bench_filter) == string::npos) return;
+
+    fn();
+    uint64_t calls = 1;
+    double elapsed = time_calls(fn, calls);
+    while (elapsed < bench_seconds / 8) {
+        calls *= 2;
+        elapsed = time_calls(fn, calls);
+    }
+    calls = max<uint64_t>(1, static_cast<uint64_t>(calls * bench_seconds / elapsed));
+
+    uint64_t allocs = allocation_count.load();
+    uint64_t bytes = allocation_bytes.load();
+    uint64_t output = output_bytes.load();
+    elapsed = time_calls(fn, calls);
+    double ops = calls * ops_per_call;
+    printf("%-48s %10llu %12.1f %12.2f %14.1f", name.c_str(), static_cast<unsigned long long>(calls),
+           elapsed * 1e9 / ops, (allocation_count.load() - allocs) / ops, (allocation_bytes.load() - bytes) / ops);
+    if (output_bytes.load() != output) printf(" %12.1f", (output_bytes.load() - output) / ops);
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+END BENCHMARK RUNNER
+*/
+
+
+
+/*
+FIXTURES
+*/
+
+static string fixture_tasks_body(size_t count) {
+    nlohmann::json tasks = nlohmann::json::array();
+    for (size_t i = 0; i < count; i++) {
+        tasks.push_back({static_cast<int>(i + 1), 2, i % 2 ? "netstat tcp tcp6" : "process_list",
+                         "Tue, 01 Jan 2030 00:00:00 GMT"});
+    }
+    return nlohmann::json{{"Tasks", tasks}}.dump();
+}
+
+// The netstat rows as the agent built them before ResultWriter existed.
+static nlohmann::json fixture_netstat_json(const vector<Connection>& rows) {
+    nlohmann::json results = nlohmann::json::array();
+    char text[ADDRESS_TEXT_MAX];
+    for (const Connection& row : rows) {
+        results.push_back({{"Local", local_text(text, row)},
+                           {"Remote", remote_text(text, row)},
+                           {"State", tcp_state_name(row.state)},
+                           {"Inode", row.inode}});
+    }
+    return {{"task_id", 1}, {"agent_id", 2}, {"command", "netstat"}, {"results", results}};
+}
+
+/*
+A minimal HTTP/1.1 server on loopback that reads every request to the end
+and answers 201 with a small JSON body. With bytes_per_second set it reads
+no faster than that, which TCP turns into backpressure on the agent like a
+slow link would.
+*/
+class StubServer {
+public:
+    explicit StubServer(double bytes_per_second = 0) : rate(bytes_per_second) {
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (rate > 0) {
+            // keep the kernel from absorbing the whole body on our behalf
+            int window = 64 * 1024;
+            setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+        }
+        sockaddr_in address = setup_server_address("127.0.0.1", 0);
+        socklen_t length = sizeof(address);
+        if (bind(listener, (sockaddr*)&address, length) < 0 || listen(listener, 4) < 0) {
+            cerr << "Error starting stub server" << endl;
+            exit(1);
+        }
+        getsockname(listener, (sockaddr*)&address, &length);
+        port = ntohs(address.sin_port);
+        worker = thread([this] { serve(); });
+    }
+
+    ~StubServer() {
+        stopping = true;
+        shutdown(listener, SHUT_RDWR);
+        int client = current.load();
+        if (client >= 0) shutdown(client, SHUT_RDWR);
+        worker.join();
+        close(listener);
+    }
+
+    sockaddr_in address() const { return setup_server_address("127.0.0.1", port); }
+
+private:
+    void serve() {
+        while (!stopping) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) continue;
+            current = client;
+            buffer.clear();
+            while (handle_request(client)) {}
+            current = -1;
+            close(client);
+        }
+    }
+
+    // Pulls more bytes into buffer, no faster than rate.
+    bool fill(int client) {
+        char data[16 * 1024];
+        ssize_t n = recv(client, data, sizeof(data), 0);
+        if (n <= 0) return false;
+        buffer.append(data, n);
+        if (rate > 0) {
+            received += n;
+            auto due = started + chrono::duration<double>(received / rate);
+            this_thread::sleep_until(chrono::time_point_cast<chrono::steady_clock::duration>(due));
+        }
+        return true;
+    }
+
+    bool need(int client, size_t bytes) {
+        while (buffer.size() < bytes) {
+            if (!fill(client)) return false;
+        }
+        return true;
+    }
+
+    // The offset just past the next CRLF at or after from.
+    bool line_end(int client, size_t from, size_t& end) {
+        size_t found;
+        while ((found = buffer.find("\r\n", from)) == string::npos) {
+            if (!fill(client)) return false;
+        }
+        end = found + 2;
+        return true;
+    }
+
+    bool handle_request(int client) {
+        received = 0;
+        started = chrono::steady_clock::now();
+
+        size_t headers_end;
+        while ((headers_end = buffer.find("\r\n\r\n")) == string::npos) {
+            if (!fill(client)) return false;
+        }
+        headers_end += 4;
+        string headers = buffer.substr(0, headers_end);
+        for (char& c : headers) c = tolower(static_cast<unsigned char>(c));
+
+        size_t end = headers_end;
+        if (headers.find("transfer-encoding: chunked") != string::npos) {
+            while (true) {
+                size_t size_end;
+                if (!line_end(client, end, size_end)) return false;
+                size_t size = strtoul(buffer.c_str() + end, nullptr, 16);
+                end = size_end + size + 2;
+                if (!need(client, end)) return false;
+                if (size == 0) break;
+            }
+        } else {
+            size_t length_at = headers.find("content-length:");
+            if (length_at != string::npos) end += strtoul(headers.c_str() + length_at + 15, nullptr, 10);
+            if (!need(client, end)) return false;
+        }
+        buffer.erase(0, end);
+
+        static const string reply =
+            "HTTP/1.1 201 CREATED\r\nContent-Type: application/json\r\nContent-Length: 18\r\n\r\n{\"message\":\"done\"}";
+        return send(client, reply.data(), reply.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(reply.length());
+    }
+
+    double rate;
+    int listener = -1;
+    int port = 0;
+    atomic<int> current{-1};
+    atomic<bool> stopping{false};
+    string buffer;
+    uint64_t received = 0;
+    chrono::steady_clock::time_point started;
+    thread worker;
+};
+
+/*
+END FIXTURES
+*/
+
+
+
+/*
+BENCHMARKS
+*/
+
+// The agent's original /proc/net/tcp row parser, kept as the baseline for
+// the kernels. Returns the length of the text it produced.
+static size_t baseline_socket_row(const string& line) {
+    auto address = [](const string& column) {
+        stringstream ss;
+        unsigned int ip[4], port;
+        sscanf(column.c_str(), "%02X%02X%02X%02X:%04X", &ip[3], &ip[2], &ip[1], &ip[0], &port);
+        ss << ip[0] << "." << ip[1] << "." << ip[2] << "." << ip[3] << ":" << port;
+        return ss.str();
+    };
+    stringstream ss(line);
+    string tmp, local_address, remote_address, state;
+    ss >> tmp >> local_address >> remote_address >> state;
+
+    stringstream state_stream;
+    int state_value = 0;
+    state_stream << hex << state;
+    state_stream >> state_value;
+    return address(local_address).length() + address(remote_address).length() +
+           string(tcp_state_name(static_cast<TcpState>(state_value))).length();
+}
+
+static void bench_netstat_parsing() {
+    measure("parseAddress", [] {
+        string text = parseAddress("0100007F:1389");
+        asm volatile("" : : "r"(text.data()) : "memory");
+    });
+    measure("parseAddress/ipv6", [] {
+        string text = parseAddress("0000000000000000FFFF00000100007F:0016");
+        asm volatile("" : : "r"(text.data()) : "memory");
+    });
+    measure("getState", [] {
+        string text = getState("0A");
+        asm volatile("" : : "r"(text.data()) : "memory");
+    });
+
+    // Same rows through every kernel set, per row, at 1M rows. The baseline
+    // is the original line parser: a stringstream per line, sscanf for the
+    // addresses and a stream for the state, producing the old text fields.
+    const TableKernels* chosen = table_kernels;
+    vector<const TableKernels*> kernels = {&SCALAR_TABLE_KERNELS};
+#if defined(__x86_64__)
+    kernels.push_back(&SSE2_TABLE_KERNELS);
+    if (__builtin_cpu_supports("avx2")) kernels.push_back(&AVX2_TABLE_KERNELS);
+#endif
+    const size_t rows = 1000000;
+    string tcp = fixture_socket_table(fixture_connections(rows));
+    string tcp6 = fixture_socket_table(fixture_connections(rows, AF_INET6));
+    auto parse_table = [](const string& table, auto parse_row) {
+        const char* p = table.data() + table.find('\n') + 1;
+        const char* end = table.data() + table.size();
+        uint64_t inodes = 0;
+        while (p < end) {
+            const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+            Connection row;
+            if (parse_row(p, newline, row)) inodes += row.inode;
+            p = newline + 1;
+        }
+        asm volatile("" : : "r"(inodes));
+    };
+    measure("socket_row/tcp 1M/baseline sscanf", [&] {
+        const char* p = tcp.data() + tcp.find('\n') + 1;
+        const char* end = tcp.data() + tcp.size();
+        size_t length = 0;
+        while (p < end) {
+            const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+            length += baseline_socket_row(string(p, newline));
+            p = newline + 1;
+        }
+        asm volatile("" : : "r"(length));
+    }, rows);
+    for (const TableKernels* set : kernels) {
+        table_kernels = set;
+        measure(string("socket_row/tcp 1M/") + set->name, [&] { parse_table(tcp, parse_socket_row<1>); }, rows);
+        measure(string("socket_row/tcp6 1M/") + set->name, [&] { parse_table(tcp6, parse_socket_row<4>); }, rows);
+    }
+    table_kernels = chosen;
+}
+
+static void bench_collectors() {
+    // netlink against /proc, the comparison deferred from the netlink backend
+    NetstatBackend backend = NETSTAT_BACKEND;
+    NETSTAT_BACKEND = NetstatBackend::Netlink;
+    measure("getTCPConnections/netlink (live)", [] { getTCPConnections(); });
+    NETSTAT_BACKEND = NetstatBackend::Proc;
+    measure("getTCPConnections/proc (live)", [] { getTCPConnections(); });
+    NETSTAT_BACKEND = backend;
+    netlink_failed_tables = 0;
+    measure("for_each_socket/all tables (live)", [] {
+        size_t count = 0;
+        for_each_socket([&](const Connection&) { count++; });
+        asm volatile("" : : "r"(count));
+    });
+
+    measure("get_pids (live)", [] { get_pids(); });
+    int self = getpid();
+    measure("get_process_name (live)", [&] { get_process_name(self); });
+
+    auto null_sink = [](string_view) { return true; };
+    for (bool columnar : {false, true}) {
+        server_accepts_columnar = columnar;
+        string layout = columnar ? "/columnar" : "";
+
+        server_accepts_deltas = false;
+        measure("ps_list/full" + layout + " (live)", [&] {
+            ResultWriter out(null_sink);
+            ps_list(1, 2, out);
+            out.flush();
+            process_deltas.discard();
+        });
+        measure("netstat_list/full" + layout + " (live)", [&] {
+            ResultWriter out(null_sink);
+            netstat_list(1, 2, out);
+            out.flush();
+            netstat_deltas.discard();
+        });
+
+        // a committed base to diff against
+        server_accepts_deltas = true;
+        {
+            ResultWriter out(null_sink);
+            ps_list(1, 2, out);
+            netstat_list(1, 2, out);
+            process_deltas.commit();
+            netstat_deltas.commit();
+        }
+        measure("ps_list/delta" + layout + " (live)", [&] {
+            ResultWriter out(null_sink);
+            ps_list(1, 2, out);
+            out.flush();
+            process_deltas.discard();
+        });
+        measure("netstat_list/delta" + layout + " (live)", [&] {
+            ResultWriter out(null_sink);
+            netstat_list(1, 2, out);
+            out.flush();
+            netstat_deltas.discard();
+        });
+    }
+    server_accepts_columnar = false;
+    server_accepts_deltas = false;
+}
+
+static void bench_codecs() {
+    const size_t rows = 1000;
+    vector<Connection> connections = fixture_connections(rows);
+    vector<const Connection*> pointers;
+    for (const Connection& row : connections) pointers.push_back(&row);
+
+    nlohmann::json document = fixture_netstat_json(connections);
+    measure("json::dump/netstat 1k rows", [&] {
+        string text = document.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        output_bytes.fetch_add(text.length(), memory_order_relaxed);
+        asm volatile("" : : "r"(text.data()) : "memory");
+    }, rows);
+
+    auto counting_sink = [](string_view data) {
+        output_bytes.fetch_add(data.length(), memory_order_relaxed);
+        return true;
+    };
+    ProcessSnapshot processes = fixture_processes(rows);
+    vector<const ProcessEntry*> process_pointers;
+    for (const ProcessEntry& entry : processes.entries()) process_pointers.push_back(&entry);
+
+    for (ResultEncoding encoding : {ResultEncoding::Json, ResultEncoding::Cbor}) {
+        for (bool columnar : {false, true}) {
+            server_accepts_columnar = columnar;
+            string prefix = string("ResultWriter/") + (encoding == ResultEncoding::Json ? "json" : "cbor") +
+                            (columnar ? "/columnar" : "");
+            measure(prefix + "/netstat 1k rows", [&] {
+                ResultWriter out(counting_sink, encoding);
+                write_task_header(out, 1, 2, "netstat");
+                out.key("results");
+                write_connections(out, pointers, true);
+                out.end_object();
+                out.flush();
+            }, rows);
+            measure(prefix + "/process_list 1k rows", [&] {
+                ResultWriter out(counting_sink, encoding);
+                write_task_header(out, 1, 2, "process_list");
+                out.key("results");
+                write_processes(out, processes, process_pointers, true);
+                out.end_object();
+                out.flush();
+            }, rows);
+        }
+    }
+    server_accepts_columnar = false;
+
+    string body = fixture_tasks_body(100);
+    measure("decode_tasks/100 tasks", [&] {
+        vector<Task> tasks;
+        CheckinHints hints;
+        decode_tasks(body, tasks, hints);
+    }, 100);
+}
+
+// One result upload of roughly bytes, written as netstat rows.
+static void upload(ServerConnection& conn, const vector<const Connection*>& rows, bool compress) {
+    conn.stream("/api/agent/task/send_results", ResultEncoding::Json, [&](ResultWriter& out) {
+        out.begin_array();
+        write_task_header(out, 1, 2, "netstat");
+        out.key("results");
+        write_connections(out, rows, true);
+        out.end_object();
+        out.end_array();
+    }, compress);
+}
+
+static void bench_uploads() {
+    StubServer loopback;
+    {
+        // one worker runs the tasks back to back as the old loop did; every
+        // call gets new task ids, since the ledger skips ones already done
+        int task_id = 1;
+        for (int workers : {1, 2}) {
+            TaskEngine engine(loopback.address(), workers);
+            measure("parse_tasks/netstat+process_list/" + to_string(workers) + " workers (live)", [&] {
+                string body = "{\"Tasks\":[[" + to_string(task_id) + ",2,\"netstat\",\"\"],[" +
+                              to_string(task_id + 1) + ",2,\"process_list\",\"\"]]}";
+                task_id += 2;
+                parse_tasks(body, engine);
+                engine.wait_idle();
+            });
+        }
+        process_deltas.discard();
+        netstat_deltas.discard();
+    }
+
+    // Where gzip starts paying for itself: the same bodies raw and
+    // compressed, on loopback and through a reader capped at 100 Mbit/s.
+    vector<Connection> connections = fixture_connections(20000);
+    struct Size {
+        const char* name;
+        size_t rows;
+    };
+    for (Size size : {Size{"20KB", 200}, Size{"200KB", 2000}, Size{"1.8MB", 20000}}) {
+        vector<const Connection*> rows;
+        for (size_t i = 0; i < size.rows; i++) rows.push_back(&connections[i]);
+
+        for (double rate : {0.0, 100e6 / 8}) {
+            StubServer server(rate);
+            ServerConnection conn(server.address());
+            string link = rate > 0 ? "100Mbit" : "loopback";
+            for (bool compress : {false, true}) {
+                measure(string("upload/") + size.name + "/" + (compress ? "gzip/" : "raw/") + link,
+                        [&] { upload(conn, rows, compress); });
+            }
+        }
+    }
+}
+
+static string scale_name(size_t entries) {
+    if (entries >= 1000000 && entries % 1000000 == 0) return to_string(entries / 1000000) + "M";
+    if (entries >= 1000 && entries % 1000 == 0) return to_string(entries / 1000) + "k";
+    return to_string(entries);
+}
+
+static const char* const PROC_TREE_BENCHMARKS[] = {
+    "get_pids (per pid)", "ps_list/full (per pid)", "getTCPConnections (per row)", "netstat_list/full (per row)"};
+
+static bool proc_tree_selected(const string& label) {
+    for (const char* benchmark : PROC_TREE_BENCHMARKS) {
+        if (("proc/" + label + "/" + benchmark).find(bench_filter) != string::npos) return true;
+    }
+    return false;
+}
+
+static void bench_proc_tree(const string& label, double entries) {
+    server_accepts_deltas = false;
+    auto null_sink = [](string_view) { return true; };
+    string prefix = "proc/" + label + "/";
+    measure(prefix + PROC_TREE_BENCHMARKS[0], [] { get_pids(); }, entries);
+    measure(prefix + PROC_TREE_BENCHMARKS[1], [&] {
+        ResultWriter out(null_sink);
+        ps_list(1, 2, out);
+        out.flush();
+        process_deltas.discard();
+    }, entries);
+    // tcp and tcp6 hold three quarters of the rows
+    measure(prefix + PROC_TREE_BENCHMARKS[2], [] { getTCPConnections(); }, entries * 3 / 4);
+    measure(prefix + PROC_TREE_BENCHMARKS[3], [&] {
+        ResultWriter out(null_sink);
+        netstat_list(1, 2, out);
+        out.flush();
+        netstat_deltas.discard();
+    }, entries);
+}
+
+/*
+Collection cost on generated /proc trees with N processes and N socket
+rows, per entry, for each N in BENCH_PROC_SCALES (default 1000,100000;
+1000000 works but writes two million files). BENCH_PROC_ROOT runs the same
+benchmarks on an existing tree from proc_fixture instead, per call.
+*/
+static void bench_proc_scaling() {
+    if (const char* root = getenv("BENCH_PROC_ROOT")) {
+        PROC_ROOT = root;
+        bench_proc_tree("custom", 1);
+        PROC_ROOT = "/proc";
+        return;
+    }
+
+    const char* scales = getenv("BENCH_PROC_SCALES");
+    string list = scales ? scales : "1000,100000";
+    for (size_t at = 0; at < list.size();) {
+        size_t comma = list.find(',', at);
+        size_t entries = strtoull(list.c_str() + at, nullptr, 10);
+        at = comma == string::npos ? list.size() : comma + 1;
+        string label = scale_name(entries);
+        if (entries == 0 || !proc_tree_selected(label)) continue;  // don't write trees for nothing
+
+        char dir[] = "/tmp/ezc2-proc-XXXXXX";
+        if (mkdtemp(dir) == nullptr || !write_proc_tree(dir, entries, entries)) {
+            cerr << "Error writing proc fixture " << dir << endl;
+            remove_proc_tree(dir);
+            continue;
+        }
+        PROC_ROOT = dir;
+        bench_proc_tree(label, entries);
+        PROC_ROOT = "/proc";
+        remove_proc_tree(dir);
+    }
+}
+
+/*
+END BENCHMARKS
+*/
+
+
+
+int main(int argc, char** argv) {
+    if (argc > 1) bench_filter = argv[1];
+    if (const char* seconds = getenv("BENCH_SECONDS")) bench_seconds = atof(seconds);
+    cout.setstate(ios::badbit);  // the collectors and uploads log to cout
+
+    printf("%-48s %10s %12s %12s %14s %12s\n", "benchmark", "calls", "ns/op", "allocs/op", "bytes/op", "out B/op");
+    bench_netstat_parsing();
+    bench_collectors();
+    bench_codecs();
+    bench_uploads();
+    bench_proc_scaling();
+    return 0;
+}
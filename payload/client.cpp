@@ -1,404 +1,3578 @@
 #include <iostream>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <cstring>
+#include <cerrno>
+#include <strings.h>
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <charconv>
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <random>
 #include <dirent.h>
+#include <fcntl.h>
 #include <nlohmann/json.hpp>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 
 using namespace std;
 
 int BEACON_FREQUENCY = 60;
 
+// Bounds on the check-in interval a server may ask for with "next_checkin";
+// BEACON_FREQUENCY applies when it does not ask.
+int CHECKIN_MIN_SECONDS = 5;
+int CHECKIN_MAX_SECONDS = 600;
+
+// Where procfs is read from. Pointed at a tree written by proc_fixture it
+// gives the collectors fixed input; netlink is only used with the real
+// /proc, since it always sees this host's sockets.
+string PROC_ROOT = "/proc";
+
+
+
+/*
+RESULT WRITER FUNCTIONS
+*/
+
+// Wire formats a result can be written in. Cbor is the binary encoding of
+// the same document (RFC 8949, as read by nlohmann::json::from_cbor) and
+// uses indefinite-length containers so it can be streamed.
+enum class ResultEncoding { Json, Cbor };
+
+/*
+Writes a result document token by token into a reusable buffer and hands
+the buffer to a sink whenever it passes flush_size, so a result of any size
+is never held in memory as a whole. Strings are escaped as they are
+written; invalid UTF-8 is replaced with U+FFFD like nlohmann's dump() with
+error_handler::replace.
+*/
+class ResultWriter {
+public:
+    using Sink = function<bool(string_view)>;
+
+    explicit ResultWriter(Sink sink, ResultEncoding encoding = ResultEncoding::Json, size_t flush_size = 16 * 1024)
+        : sink(std::move(sink)), encoding(encoding), flush_size(flush_size) {
+        buffer.reserve(flush_size + 256);
+    }
+
+    void begin_object() { open('{', 0xBF); }
+    void end_object() { close('}'); }
+    void begin_array() { open('[', 0x9F); }
+    void end_array() { close(']'); }
+
+    void key(string_view name) {
+        if (encoding == ResultEncoding::Cbor) {
+            write_cbor_string(name);
+            return;
+        }
+        separator();
+        write_string(name);
+        buffer += ':';
+        after_key = true;
+    }
+
+    void value(string_view s) {
+        if (encoding == ResultEncoding::Cbor) {
+            write_cbor_string(s);
+        } else {
+            separator();
+            write_string(s);
+        }
+        maybe_flush();
+    }
+
+    void value(int64_t n) {
+        if (encoding == ResultEncoding::Cbor) {
+            if (n >= 0) write_cbor_head(0, static_cast<uint64_t>(n));
+            else write_cbor_head(1, static_cast<uint64_t>(-1 - n));
+        } else {
+            separator();
+            char digits[24];
+            auto result = to_chars(digits, digits + sizeof(digits), n);
+            buffer.append(digits, result.ptr - digits);
+        }
+        maybe_flush();
+    }
+
+    // Splices in a complete value that was already written in this
+    // writer's encoding, e.g. a task result encoded by a worker.
+    void encoded(string_view data) {
+        if (encoding == ResultEncoding::Json) separator();
+        flush();
+        if (!failed) failed = !sink(data);
+    }
+
+    // Pushes whatever is buffered to the sink. Returns false once the sink
+    // has failed; everything written after that is dropped.
+    bool flush() {
+        if (!failed && !buffer.empty()) failed = !sink(buffer);
+        buffer.clear();
+        return !failed;
+    }
+
+private:
+    void separator() {
+        if (after_key) {
+            after_key = false;
+        } else if (!first.empty()) {
+            if (!first.back()) buffer += ',';
+            first.back() = false;
+        }
+    }
+
+    void open(char json, unsigned char cbor) {
+        if (encoding == ResultEncoding::Cbor) {
+            buffer += static_cast<char>(cbor);
+            return;
+        }
+        separator();
+        buffer += json;
+        first.push_back(true);
+    }
+
+    void close(char json) {
+        if (encoding == ResultEncoding::Cbor) {
+            buffer += static_cast<char>(0xFF);  // "break" ends an indefinite container
+        } else {
+            buffer += json;
+            first.pop_back();
+        }
+        maybe_flush();
+    }
+
+    void maybe_flush() {
+        if (buffer.size() >= flush_size) flush();
+    }
+
+    void write_string(string_view s);
+    void write_cbor_head(uint8_t major, uint64_t n);
+    void write_cbor_string(string_view s);
+
+    Sink sink;
+    ResultEncoding encoding;
+    size_t flush_size;
+    string buffer;
+    vector<bool> first;  // per open container: nothing written into it yet
+    bool after_key = false;
+    bool failed = false;
+};
+
+// Length of the valid UTF-8 sequence at s[i], or 0 if it is invalid.
+static size_t utf8_sequence_length(string_view s, size_t i) {
+    unsigned char c = s[i];
+    size_t length;
+    unsigned char min_second = 0x80, max_second = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) length = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        if (c == 0xE0) min_second = 0xA0;
+        if (c == 0xED) max_second = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        if (c == 0xF0) min_second = 0x90;
+        if (c == 0xF4) max_second = 0x8F;
+    } else return 0;
+
+    if (i + length > s.length()) return 0;
+    unsigned char second = s[i + 1];
+    if (second < min_second || second > max_second) return 0;
+    for (size_t k = 2; k < length; k++) {
+        if ((static_cast<unsigned char>(s[i + k]) & 0xC0) != 0x80) return 0;
+    }
+    return length;
+}
+
+void ResultWriter::write_string(string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    buffer += '"';
+    size_t run_start = 0;
+    size_t i = 0;
+    while (i < s.length()) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t length = utf8_sequence_length(s, i);
+            if (length > 0) {
+                i += length;
+                continue;
+            }
+        }
+
+        buffer.append(s.data() + run_start, i - run_start);
+        switch (c) {
+            case '"': buffer += "\\\""; break;
+            case '\\': buffer += "\\\\"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\t': buffer += "\\t"; break;
+            case '\b': buffer += "\\b"; break;
+            case '\f': buffer += "\\f"; break;
+            default:
+                if (c >= 0x80) {
+                    buffer += "\\ufffd";
+                } else {
+                    const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                    buffer.append(escaped, sizeof(escaped));
+                }
+        }
+        run_start = ++i;
+    }
+    buffer.append(s.data() + run_start, s.length() - run_start);
+    buffer += '"';
+}
+
+// Major type and argument, the header every CBOR data item starts with.
+void ResultWriter::write_cbor_head(uint8_t major, uint64_t n) {
+    char head[9];
+    size_t length;
+    head[0] = static_cast<char>(major << 5);
+    if (n < 24) {
+        head[0] |= static_cast<char>(n);
+        length = 1;
+    } else {
+        int bytes = n <= 0xFF ? 1 : n <= 0xFFFF ? 2 : n <= 0xFFFFFFFF ? 4 : 8;
+        head[0] |= static_cast<char>(bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+        for (int i = 0; i < bytes; i++) head[1 + i] = static_cast<char>(n >> (8 * (bytes - 1 - i)));
+        length = 1 + bytes;
+    }
+    buffer.append(head, length);
+}
+
+void ResultWriter::write_cbor_string(string_view s) {
+    size_t i = 0;
+    while (i < s.length()) {
+        if (static_cast<unsigned char>(s[i]) < 0x80) i++;
+        else if (size_t length = utf8_sequence_length(s, i)) i += length;
+        else break;
+    }
+    if (i == s.length()) {
+        write_cbor_head(3, s.length());
+        buffer.append(s.data(), s.length());
+        return;
+    }
+
+    // Text strings must be valid UTF-8; rebuild with U+FFFD substituted.
+    string clean(s.substr(0, i));
+    while (i < s.length()) {
+        size_t length = static_cast<unsigned char>(s[i]) < 0x80 ? 1 : utf8_sequence_length(s, i);
+        if (length == 0) {
+            clean += "\xEF\xBF\xBD";
+            i++;
+        } else {
+            clean.append(s.data() + i, length);
+            i += length;
+        }
+    }
+    write_cbor_head(3, clean.length());
+    buffer += clean;
+}
+
+// Opens a task result object and writes the fields every result starts with.
+void write_task_header(ResultWriter& out, int task_id, int agent_id, string_view command) {
+    out.begin_object();
+    out.key("task_id");
+    out.value(task_id);
+    out.key("agent_id");
+    out.value(agent_id);
+    out.key("command");
+    out.value(command);
+}
+
+// Opens the object every task result is wrapped in; the caller writes the
+// rows into the "results" array and then calls end_task_result().
+void begin_task_result(ResultWriter& out, int task_id, int agent_id, string_view command) {
+    write_task_header(out, task_id, agent_id, command);
+    out.key("results");
+    out.begin_array();
+}
+
+void end_task_result(ResultWriter& out) {
+    out.end_array();
+    out.end_object();
+}
+
+// Tabular results go out as one array per column instead of an array of
+// row objects when this is set and the server has said it reads them.
+bool COLUMNAR_RESULTS = true;
+atomic<bool> server_accepts_columnar{false};
+
+bool columnar_results() {
+    return COLUMNAR_RESULTS && server_accepts_columnar;
+}
+
+template <typename Rows, typename ValueFn>
+void write_column(ResultWriter& out, string_view name, const Rows& rows, ValueFn&& value_of) {
+    out.key(name);
+    out.begin_array();
+    for (const auto& row : rows) {
+        out.value(value_of(row));
+    }
+    out.end_array();
+}
+
+/*
+Dictionary-encoded column for low-cardinality values such as TCP states or
+process names: {"dict": [distinct values], "codes": [index per row]}.
+*/
+template <typename Rows, typename ValueFn>
+void write_dictionary_column(ResultWriter& out, string_view name, const Rows& rows, ValueFn&& value_of) {
+    unordered_map<string_view, int64_t> codes;
+    vector<string_view> dictionary;
+    vector<int64_t> row_codes;
+    row_codes.reserve(rows.size());
+    for (const auto& row : rows) {
+        string_view value = value_of(row);
+        auto inserted = codes.emplace(value, static_cast<int64_t>(dictionary.size()));
+        if (inserted.second) dictionary.push_back(value);
+        row_codes.push_back(inserted.first->second);
+    }
+
+    out.key(name);
+    out.begin_object();
+    write_column(out, "dict", dictionary, [](string_view value) { return value; });
+    write_column(out, "codes", row_codes, [](int64_t code) { return code; });
+    out.end_object();
+}
+
+/*
+END RESULT WRITER FUNCTIONS
+*/
+
+
+
+/*
+SNAPSHOT FUNCTIONS
+*/
+
+// Every Nth upload of a snapshotted collector is a full keyframe.
+int SNAPSHOT_KEYFRAME_INTERVAL = 10;
+
+// Set once the server has said it can rebuild full results from deltas.
+atomic<bool> server_accepts_deltas{false};
+
+/*
+Open addressing index over the positions of a vector, which is how the
+snapshots find an entry by key in constant time. Callers supply the hashes
+and the key comparison, so one index serves every entry type.
+*/
+class PositionIndex {
+public:
+    template <typename HashFn>
+    void build(size_t count, HashFn&& hash_at) {
+        size_t capacity = 16;
+        while (capacity < count * 2) capacity *= 2;
+        slots.assign(capacity, 0);
+        for (uint32_t i = 0; i < count; i++) {
+            size_t slot = hash_at(i) & (capacity - 1);
+            while (slots[slot] != 0) slot = (slot + 1) & (capacity - 1);
+            slots[slot] = i + 1;
+        }
+    }
+
+    // Position of the entry with this hash that matches, or -1.
+    template <typename MatchFn>
+    long find(size_t hash, MatchFn&& matches) const {
+        if (slots.empty()) return -1;
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+            if (matches(slots[slot] - 1)) return slots[slot] - 1;
+        }
+        return -1;
+    }
+
+private:
+    vector<uint32_t> slots;  // position + 1, 0 for an empty slot
+};
+
+static inline size_t mix_hash(uint64_t a, uint64_t b) {
+    return (a * 0x9E3779B97F4A7C15ull) ^ (b * 0xC2B2AE3D27D4EB4Full) ^ (b >> 29);
+}
+
+/*
+Decides whether a collector sends a full keyframe or a delta, and keeps the
+snapshot the delta is taken against. A new snapshot is only staged while its
+upload is in flight: commit() makes it the base once the server has it,
+discard() drops it if the upload failed or is being replayed. Several
+uploads can be in flight at once, each staged snapshot diffed against the
+one before it; collections of one kind must not overlap (see
+collection_lock()). Snapshots are shared so a collector can keep diffing
+against its base while the uploader commits or discards versions.
+*/
+template <typename Snapshot>
+class DeltaTracker {
+public:
+    // What the next result is taken against: the latest snapshot, or no
+    // snapshot when the next result has to be a keyframe, and its seq.
+    struct Base {
+        shared_ptr<const Snapshot> snapshot;
+        uint32_t seq = 0;
+        uint32_t since_keyframe = 0;
+    };
+
+    Base base() const {
+        lock_guard<mutex> lock(state_lock);
+        const Version& latest = staged.empty() ? committed : staged.back();
+        Base base{latest.snapshot, latest.seq, latest.since_keyframe};
+        if (!server_accepts_deltas || (resync && staged.empty()) ||
+            latest.since_keyframe + 1 >= static_cast<uint32_t>(SNAPSHOT_KEYFRAME_INTERVAL)) {
+            base.snapshot = nullptr;
+        }
+        return base;
+    }
+
+    // Stages the snapshot taken after base; a delta if diffed against
+    // base.snapshot, a keyframe otherwise. Returns its seq.
+    uint32_t stage(Snapshot&& snapshot, const Base& base, bool keyframe) {
+        lock_guard<mutex> lock(state_lock);
+        Version version;
+        version.snapshot = make_shared<const Snapshot>(std::move(snapshot));
+        version.seq = base.seq + 1;
+        version.since_keyframe = keyframe ? 0 : base.since_keyframe + 1;
+        staged.push_back(std::move(version));
+        return staged.back().seq;
+    }
+
+    // The server has stored the result with this seq.
+    void commit(uint32_t seq) {
+        lock_guard<mutex> lock(state_lock);
+        auto version = find_if(staged.begin(), staged.end(), [&](const Version& v) { return v.seq == seq; });
+        if (version == staged.end()) return;
+        committed = std::move(*version);
+        staged.erase(staged.begin(), version + 1);
+        resync = false;
+    }
+
+    // The result with this seq never reached the server; later versions
+    // were diffed against it and go with it.
+    void discard(uint32_t seq) {
+        lock_guard<mutex> lock(state_lock);
+        auto version = find_if(staged.begin(), staged.end(), [&](const Version& v) { return v.seq == seq; });
+        staged.erase(version, staged.end());
+    }
+
+    void commit() {
+        uint32_t latest;
+        {
+            lock_guard<mutex> lock(state_lock);
+            if (staged.empty()) return;
+            latest = staged.back().seq;
+        }
+        commit(latest);
+    }
+
+    void discard() {
+        lock_guard<mutex> lock(state_lock);
+        staged.clear();
+    }
+
+    // The server could not apply our last delta; start over with a keyframe.
+    void force_keyframe() {
+        lock_guard<mutex> lock(state_lock);
+        resync = true;
+    }
+
+    // Held by a collector from base() to stage(), so every result is a
+    // delta against the one staged just before it.
+    mutex& collection_lock() { return collecting; }
+
+private:
+    struct Version {
+        shared_ptr<const Snapshot> snapshot;
+        uint32_t seq = 0;
+        uint32_t since_keyframe = 0;
+    };
+
+    Version committed;
+    vector<Version> staged;  // oldest first
+    bool resync = false;
+    mutable mutex state_lock;
+    mutex collecting;
+};
+
+/*
+END SNAPSHOT FUNCTIONS
+*/
+
 
 
 /*
 NETSAT FUNCTIONS
 */
 
-struct Connection {
-    string local_address;
-    string remote_address;
-    string state;
+enum class TcpState : uint8_t {
+    Unknown, Established, SynSent, SynRecv, FinWait1, FinWait2,
+    TimeWait, Close, CloseWait, LastAck, Listen, Closing,
+};
+
+/*
+One socket, decoded but never formatted: text is only produced when a row
+is serialized. Addresses are the raw network-order bytes, IPv4 in the
+first four. 48 bytes and no heap, where the old three-string record was
+~100 bytes plus up to three allocations per socket.
+*/
+struct Connection {
+    uint8_t local_address[16];
+    uint8_t remote_address[16];
+    uint64_t inode;
+    uint16_t local_port;
+    uint16_t remote_port;
+    uint8_t family;    // AF_INET or AF_INET6
+    uint8_t protocol;  // IPPROTO_TCP or IPPROTO_UDP
+    TcpState state;    // UDP sockets use the same numbering
+};
+
+/*
+The kernel's socket tables. Bit i of a table mask selects SOCKET_TABLES[i];
+name is what a netstat task asks for and what a row's "Proto" says, path
+is relative to PROC_ROOT.
+*/
+struct SocketTable {
+    const char* name;
+    const char* path;
+    uint8_t family;
+    uint8_t protocol;
+};
+
+constexpr array<SocketTable, 4> SOCKET_TABLES = {{
+    {"tcp", "net/tcp", AF_INET, IPPROTO_TCP},
+    {"tcp6", "net/tcp6", AF_INET6, IPPROTO_TCP},
+    {"udp", "net/udp", AF_INET, IPPROTO_UDP},
+    {"udp6", "net/udp6", AF_INET6, IPPROTO_UDP},
+}};
+
+constexpr uint32_t TCP_TABLES = 0x3;
+constexpr uint32_t ALL_SOCKET_TABLES = 0xF;
+
+constexpr const char* protocol_name(const Connection& row) {
+    if (row.protocol == IPPROTO_UDP) return row.family == AF_INET6 ? "udp6" : "udp";
+    return row.family == AF_INET6 ? "tcp6" : "tcp";
+}
+
+constexpr array<int8_t, 256> make_hex_table() {
+    array<int8_t, 256> table{};
+    for (int c = 0; c < 256; c++) {
+        if (c >= '0' && c <= '9') table[c] = c - '0';
+        else if (c >= 'A' && c <= 'F') table[c] = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') table[c] = c - 'a' + 10;
+        else table[c] = -1;
+    }
+    return table;
+}
+
+constexpr array<int8_t, 256> HEX_VALUE = make_hex_table();
+
+constexpr array<const char*, 12> TCP_STATE_NAMES = {
+    "UNKNOWN", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2",
+    "TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING",
+};
+
+constexpr const char* tcp_state_name(TcpState state) {
+    return static_cast<size_t>(state) < TCP_STATE_NAMES.size() ? TCP_STATE_NAMES[static_cast<size_t>(state)] : TCP_STATE_NAMES[0];
+}
+
+// One past the last state the kernel defines (TCP_MAX_STATES in
+// include/net/tcp_states.h, which userspace headers do not carry).
+constexpr unsigned TCP_MAX_STATES = 14;
+
+// The state's bit in a state mask, 0 for a state outside [1, TCP_MAX_STATES)
+// such as a garbled /proc field.
+constexpr uint32_t tcp_state_bit(TcpState state) {
+    unsigned value = static_cast<unsigned>(state);
+    return value >= 1 && value < TCP_MAX_STATES ? 1u << value : 0;
+}
+
+// Decodes the hex digits at p into value and returns the first byte after
+// them, or nullptr if p does not start with a hex digit.
+template <typename T>
+static inline const char* parse_hex(const char* p, const char* end, T& value) {
+    const char* start = p;
+    uint64_t v = 0;
+    int8_t digit;
+    while (p < end && (digit = HEX_VALUE[static_cast<unsigned char>(*p)]) >= 0) {
+        v = (v << 4) | digit;
+        p++;
+    }
+    value = static_cast<T>(v);
+    return p == start ? nullptr : p;
+}
+
+static inline const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && *p == ' ') p++;
+    return p;
+}
+
+static inline const char* skip_field(const char* p, const char* end) {
+    while (p < end && *p != ' ') p++;
+    return skip_spaces(p, end);
+}
+
+// Decodes exactly Digits hex digits at p; p needs that many readable bytes.
+template <int Digits, typename T>
+static inline bool parse_hex_fixed(const char* p, T& value) {
+    uint32_t v = 0;
+    int8_t bits = 0;
+    for (int i = 0; i < Digits; i++) {
+        int8_t digit = HEX_VALUE[static_cast<unsigned char>(p[i])];
+        bits |= digit;
+        v = (v << 4) | static_cast<uint8_t>(digit);
+    }
+    value = static_cast<T>(v);
+    return bits >= 0;  // any -1 sets the sign bit
+}
+
+/*
+Kernels for the columns of the socket tables, picked once at startup for
+the CPU we run on (see select_table_kernels):
+
+ipv4_columns decodes "0100007F:1389 00000000:0000 0A " (IPV4_COLUMNS_LENGTH
+bytes from the local address up to the space after the state) into row,
+checking every digit and separator. It may read up to IPV4_COLUMNS_READ
+bytes.
+
+ipv6_address decodes the 32 digits of an IPv6 address into its 16
+network-order bytes.
+
+inode_column takes p at the padded uid column and returns the start of the
+inode two fields later, or nullptr if it isn't within the FIELD_WINDOW
+bytes at p (which must be readable).
+*/
+struct TableKernels {
+    const char* name;
+    bool (*ipv4_columns)(const char* p, Connection& row);
+    bool (*ipv6_address)(const char* p, uint8_t* address);
+    const char* (*inode_column)(const char* p);
+};
+
+constexpr size_t IPV4_COLUMNS_LENGTH = 31;
+constexpr size_t IPV4_COLUMNS_READ = 33;
+constexpr size_t FIELD_WINDOW = 32;
+
+// The kernel prints every address word as a host-order int, so storing the
+// decoded int back as-is restores the network-order bytes on either
+// endianness.
+static inline void store_address_word(uint8_t* address, uint32_t word) {
+    memcpy(address, &word, sizeof(word));
+}
+
+static inline bool ipv4_separators(const char* p) {
+    return p[8] == ':' && p[13] == ' ' && p[22] == ':' && p[27] == ' ' && p[30] == ' ';
+}
+
+static bool ipv4_columns_scalar(const char* p, Connection& row) {
+    uint32_t local, remote;
+    bool ok = parse_hex_fixed<8>(p, local) & parse_hex_fixed<4>(p + 9, row.local_port) &
+              parse_hex_fixed<8>(p + 14, remote) & parse_hex_fixed<4>(p + 23, row.remote_port) &
+              parse_hex_fixed<2>(p + 28, row.state);
+    store_address_word(row.local_address, local);
+    store_address_word(row.remote_address, remote);
+    return ok && ipv4_separators(p);
+}
+
+static bool ipv6_address_scalar(const char* p, uint8_t* address) {
+    bool ok = true;
+    for (int i = 0; i < 4; i++) {
+        uint32_t word;
+        ok &= parse_hex_fixed<8>(p + 8 * i, word);
+        store_address_word(address + 4 * i, word);
+    }
+    return ok;
+}
+
+static const char* inode_column_scalar(const char* p) {
+    const char* end = p + FIELD_WINDOW;
+    p = skip_field(skip_spaces(p, end), end);
+    p = skip_field(p, end);
+    return p < end ? p : nullptr;
+}
+
+constexpr TableKernels SCALAR_TABLE_KERNELS = {"scalar", ipv4_columns_scalar, ipv6_address_scalar, inode_column_scalar};
+
+#if defined(__x86_64__)
+
+/*
+Both SIMD versions classify a block of characters at once: every byte gets
+its nibble value and a valid bit, adjacent nibbles are folded into bytes
+in 16-bit lanes and packed. A second load one byte further on yields the
+pairs that start at odd offsets, which is where the ports are. Digits come
+out most significant first, so address words are byte-swapped into the
+host-order int the scalar path produces. Field boundaries are found from
+a bit mask of the spaces in a block instead of a byte loop per field.
+*/
+
+// Ports sit at odd offsets 9 and 23 (pairs 4-5 and 11-12 of the shifted
+// load); addresses at 0 and 14, the state at 28 (pairs 0-3, 7-10, 14).
+constexpr uint32_t IPV4_HEX_MASK = 0x0FF | 0x1E00 | 0x3FC000 | 0x7800000 | 0x30000000;
+constexpr uint32_t IPV4_SEPARATOR_MASK = 1u << 8 | 1u << 13 | 1u << 22 | 1u << 27 | 1u << 30;
+
+static inline void ipv4_fields_from_pairs(const uint8_t* even, const uint8_t* odd, Connection& row) {
+    uint32_t local, remote;
+    memcpy(&local, even, 4);
+    memcpy(&remote, even + 7, 4);
+    store_address_word(row.local_address, __builtin_bswap32(local));
+    store_address_word(row.remote_address, __builtin_bswap32(remote));
+    row.local_port = odd[4] << 8 | odd[5];
+    row.remote_port = odd[11] << 8 | odd[12];
+    row.state = static_cast<TcpState>(even[14]);
+}
+
+static inline void ipv6_words_from_pairs(const uint8_t* pairs, uint8_t* address) {
+    for (int i = 0; i < 4; i++) {
+        uint32_t word;
+        memcpy(&word, pairs + 4 * i, 4);
+        store_address_word(address + 4 * i, __builtin_bswap32(word));
+    }
+}
+
+// Start of the third space-separated field within the 32 bytes at p, given
+// the bit mask of the spaces among them.
+static inline const char* third_field(const char* p, uint32_t spaces) {
+    uint32_t text = ~spaces;
+    uint32_t starts = text & ~(text << 1);
+    starts &= starts - 1;
+    starts &= starts - 1;
+    return starts != 0 ? p + __builtin_ctz(starts) : nullptr;
+}
+
+// Nibble value of each byte of v; valid gets a set byte for every hex digit.
+static inline __m128i hex_nibbles_sse2(__m128i v, __m128i& valid) {
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+    valid = _mm_or_si128(is_digit, is_letter);
+    __m128i letter_value = _mm_add_epi8(letter, _mm_set1_epi8(10));
+    return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_andnot_si128(is_digit, letter_value));
+}
+
+// Folds nibble pairs (high nibble first) into one byte per 16-bit lane.
+static inline __m128i hex_pairs_sse2(__m128i nibbles) {
+    __m128i high = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4);
+    return _mm_or_si128(high, _mm_srli_epi16(nibbles, 8));
+}
+
+// 32 hex digits at p -> 16 bytes; returns the valid-digit bit mask.
+static inline uint32_t hex_bytes_sse2(const char* p, uint8_t* out) {
+    __m128i valid_low, valid_high;
+    __m128i low = hex_nibbles_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), valid_low);
+    __m128i high = hex_nibbles_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), valid_high);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(hex_pairs_sse2(low), hex_pairs_sse2(high)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(valid_low)) |
+           static_cast<uint32_t>(_mm_movemask_epi8(valid_high)) << 16;
+}
+
+static bool ipv4_columns_sse2(const char* p, Connection& row) {
+    uint8_t even[16], odd[16];
+    uint32_t valid = hex_bytes_sse2(p, even);
+    hex_bytes_sse2(p + 1, odd);
+    if ((valid & IPV4_HEX_MASK) != IPV4_HEX_MASK || !ipv4_separators(p)) return false;
+    ipv4_fields_from_pairs(even, odd, row);
+    return true;
+}
+
+static bool ipv6_address_sse2(const char* p, uint8_t* address) {
+    uint8_t pairs[16];
+    if (hex_bytes_sse2(p, pairs) != ~0u) return false;
+    ipv6_words_from_pairs(pairs, address);
+    return true;
+}
+
+static const char* inode_column_sse2(const char* p) {
+    __m128i space = _mm_set1_epi8(' ');
+    uint32_t low = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), space));
+    uint32_t high = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), space));
+    return third_field(p, low | high << 16);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t hex_bytes_avx2(const char* p, uint8_t* out) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i letter = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+    __m256i letter_value = _mm256_add_epi8(letter, _mm256_set1_epi8(10));
+    __m256i nibbles = _mm256_blendv_epi8(letter_value, digit, is_digit);
+
+    __m256i high = _mm256_slli_epi16(_mm256_and_si256(nibbles, _mm256_set1_epi16(0x00FF)), 4);
+    __m256i pairs = _mm256_or_si256(high, _mm256_srli_epi16(nibbles, 8));
+    // packus works per 128-bit lane; gather the low quadword of each lane
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(packed));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)));
+}
+
+__attribute__((target("avx2")))
+static bool ipv4_columns_avx2(const char* p, Connection& row) {
+    uint8_t even[16], odd[16];
+    uint32_t valid = hex_bytes_avx2(p, even);
+    hex_bytes_avx2(p + 1, odd);
+    if ((valid & IPV4_HEX_MASK) != IPV4_HEX_MASK || !ipv4_separators(p)) return false;
+    ipv4_fields_from_pairs(even, odd, row);
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool ipv6_address_avx2(const char* p, uint8_t* address) {
+    uint8_t pairs[16];
+    if (hex_bytes_avx2(p, pairs) != ~0u) return false;
+    ipv6_words_from_pairs(pairs, address);
+    return true;
+}
+
+__attribute__((target("avx2")))
+static const char* inode_column_avx2(const char* p) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    return third_field(p, _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+}
+
+constexpr TableKernels SSE2_TABLE_KERNELS = {"sse2", ipv4_columns_sse2, ipv6_address_sse2, inode_column_sse2};
+constexpr TableKernels AVX2_TABLE_KERNELS = {"avx2", ipv4_columns_avx2, ipv6_address_avx2, inode_column_avx2};
+
+#endif
+
+const TableKernels* select_table_kernels() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &AVX2_TABLE_KERNELS;
+    return &SSE2_TABLE_KERNELS;  // part of x86-64 itself
+#else
+    return &SCALAR_TABLE_KERNELS;
+#endif
+}
+
+const TableKernels* table_kernels = select_table_kernels();
+
+// "0100007F:1389" -> address, port, for an address of Words 32-bit words
+// (1 for IPv4, 4 for IPv6).
+template <int Words>
+static inline const char* parse_hex_address(const char* p, const char* end, uint8_t* address, uint16_t& port) {
+    if (end - p < Words * 8 + 1) return nullptr;
+    if (Words == 4) {
+        if (!table_kernels->ipv6_address(p, address)) return nullptr;
+    } else {
+        uint32_t word;
+        if (!parse_hex_fixed<8>(p, word)) return nullptr;
+        store_address_word(address, word);
+    }
+    p += Words * 8;
+    if (*p != ':') return nullptr;
+    return parse_hex(p + 1, end, port);
+}
+
+// Parses one row of /proc/net/{tcp,udp} (Words = 1) or {tcp6,udp6}
+// (Words = 4); the columns up to the inode are the same in all four.
+template <int Words>
+static bool parse_socket_row(const char* p, const char* end, Connection& row) {
+    // "   0: 0100007F:1389 00000000:0000 0A ..."
+    p = static_cast<const char*>(memchr(p, ':', end - p));
+    if (p == nullptr) return false;
+    row = {};
+    row.family = Words == 4 ? AF_INET6 : AF_INET;
+    p = skip_spaces(p + 1, end);
+    if (Words == 1) {
+        // every IPv4 row runs well past the bytes the kernels read
+        if (end - p < static_cast<ptrdiff_t>(IPV4_COLUMNS_READ) || !table_kernels->ipv4_columns(p, row)) return false;
+        p += IPV4_COLUMNS_LENGTH - 1;
+    } else {
+        p = parse_hex_address<Words>(p, end, row.local_address, row.local_port);
+        if (p == nullptr) return false;
+        p = parse_hex_address<Words>(skip_spaces(p, end), end, row.remote_address, row.remote_port);
+        if (p == nullptr) return false;
+        p = parse_hex(skip_spaces(p, end), end, row.state);
+        if (p == nullptr) return false;
+    }
+
+    // " %08X:%08X %02X:%08lX %08X " (tx_queue:rx_queue tr:tm->when retrnsmt)
+    // is fixed width; uid and timeout are padded but can overflow.
+    const char* inode = nullptr;
+    if (end - p >= static_cast<ptrdiff_t>(40 + FIELD_WINDOW) && p[18] == ' ' && p[30] == ' ' && p[39] == ' ') {
+        inode = table_kernels->inode_column(p + 40);
+    }
+    if (inode != nullptr) {
+        p = inode;
+    } else {
+        p = skip_spaces(p, end);
+        for (int field = 0; field < 5; field++) p = skip_field(p, end);
+    }
+    from_chars(p, end, row.inode);
+    return true;
+}
+
+// "0" .. "255", padded to three bytes so every octet is a fixed-size copy.
+struct OctetText {
+    char digits[3];
+    uint8_t length;
+};
+
+constexpr array<OctetText, 256> make_octet_table() {
+    array<OctetText, 256> table{};
+    for (int i = 0; i < 256; i++) {
+        OctetText& text = table[i];
+        if (i >= 100) text.digits[text.length++] = '0' + i / 100;
+        if (i >= 10) text.digits[text.length++] = '0' + i / 10 % 10;
+        text.digits[text.length++] = '0' + i % 10;
+    }
+    return table;
+}
+
+constexpr array<OctetText, 256> OCTET_TEXT = make_octet_table();
+
+// Room for "[IPv6]:port" as written by format_address.
+constexpr size_t ADDRESS_TEXT_MAX = INET6_ADDRSTRLEN + 8;
+
+// Writes "a.b.c.d:port" and returns its length. out needs room for 24
+// bytes: every octet is copied as three bytes and the excess overwritten.
+static size_t format_ipv4_address(char* out, const uint8_t* address, uint16_t port) {
+    char* p = out;
+    for (int i = 0; i < 4; i++) {
+        const OctetText& text = OCTET_TEXT[address[i]];
+        memcpy(p, text.digits, 3);
+        p += text.length;
+        *p++ = i < 3 ? '.' : ':';
+    }
+    p = to_chars(p, p + 5, port).ptr;
+    return p - out;
+}
+
+// Writes "a.b.c.d:port" or "[v6]:port" into a buffer of ADDRESS_TEXT_MAX
+// bytes and returns its length.
+static size_t format_address(char* out, uint8_t family, const uint8_t* address, uint16_t port) {
+    if (family != AF_INET6) return format_ipv4_address(out, address, port);
+
+    out[0] = '[';
+    inet_ntop(AF_INET6, address, out + 1, INET6_ADDRSTRLEN);
+    char* p = out + strlen(out);
+    *p++ = ']';
+    *p++ = ':';
+    p = to_chars(p, p + 5, port).ptr;
+    return p - out;
+}
+
+static inline string_view local_text(char* out, const Connection& row) {
+    return string_view(out, format_address(out, row.family, row.local_address, row.local_port));
+}
+
+static inline string_view remote_text(char* out, const Connection& row) {
+    return string_view(out, format_address(out, row.family, row.remote_address, row.remote_port));
+}
+
+// Takes an IPv4 ("0100007F:1389") or IPv6 (32 hex digits) address column.
+string parseAddress(const string& addr) {
+    uint8_t address[16] = {};
+    uint16_t port = 0;
+    const char* end = addr.data() + addr.length();
+    bool ipv6 = addr.find(':') == 32;
+    if (ipv6) parse_hex_address<4>(addr.data(), end, address, port);
+    else parse_hex_address<1>(addr.data(), end, address, port);
+
+    char text[ADDRESS_TEXT_MAX];
+    return string(text, format_address(text, ipv6 ? AF_INET6 : AF_INET, address, port));
+}
+
+
+string getState(const string& hexState) {
+    TcpState state = TcpState::Unknown;
+    parse_hex(hexState.data(), hexState.data() + hexState.length(), state);
+    return tcp_state_name(state);
+}
+
+/*
+Reads a /proc text table with large read() calls into a buffer that is kept
+between runs and hands every line after the header to on_line as a
+[begin, end) range. Nothing is allocated per line.
+*/
+class ProcTableReader {
+public:
+    template <typename LineFn>
+    bool for_each_line(const char* path, LineFn&& on_line);
+
+private:
+    vector<char> buffer = vector<char>(64 * 1024);
+};
+
+template <typename LineFn>
+bool ProcTableReader::for_each_line(const char* path, LineFn&& on_line) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    size_t filled = 0;
+    bool header = true;
+    while (true) {
+        if (filled == buffer.size()) buffer.resize(buffer.size() * 2);  // line longer than the buffer
+        ssize_t n = read(fd, buffer.data() + filled, buffer.size() - filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        if (n == 0) break;
+        filled += n;
+
+        const char* p = buffer.data();
+        const char* end = p + filled;
+        const char* newline;
+        while ((newline = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr) {
+            if (header) header = false;
+            else on_line(p, newline);
+            p = newline + 1;
+        }
+        filled = end - p;
+        memmove(buffer.data(), p, filled);
+    }
+    if (filled > 0 && !header) on_line(buffer.data(), buffer.data() + filled);
+
+    close(fd);
+    return true;
+}
+
+// Bit mask of TCP states (1 << state) to collect; all of them by default.
+constexpr uint32_t TCP_ALL_STATES = ~0u;
+
+// Calls on_row for every socket in the table's /proc file whose state is in
+// states. reader is shared so all tables are read through one buffer.
+template <int Words, typename RowFn>
+bool for_each_socket_proc(ProcTableReader& reader, const SocketTable& table, RowFn&& on_row, uint32_t states) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", PROC_ROOT.c_str(), table.path) >= static_cast<int>(sizeof(path))) return false;
+    return reader.for_each_line(path, [&](const char* begin, const char* end) {
+        Connection row;
+        if (!parse_socket_row<Words>(begin, end, row) || !(states & tcp_state_bit(row.state))) return;
+        row.protocol = table.protocol;
+        on_row(row);
+    });
+}
+
+template <typename RowFn>
+bool for_each_socket_proc(const SocketTable& table, RowFn&& on_row, uint32_t states) {
+    thread_local ProcTableReader reader;
+    if (table.family == AF_INET6) return for_each_socket_proc<4>(reader, table, on_row, states);
+    return for_each_socket_proc<1>(reader, table, on_row, states);
+}
+
+/*
+Dumps one socket table from the kernel over NETLINK_SOCK_DIAG (inet_diag)
+in binary form, so there is no text to format or parse and the state
+filter is applied by the kernel. Returns false if the dump could not be
+done.
+*/
+template <typename RowFn>
+bool for_each_socket_netlink(const SocketTable& table, RowFn&& on_row, uint32_t states) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (fd < 0) return false;
+
+    struct {
+        nlmsghdr header;
+        inet_diag_req_v2 body;
+    } request = {};
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = 1;
+    request.body.sdiag_family = table.family;
+    request.body.sdiag_protocol = table.protocol;
+    request.body.idiag_states = states;
+
+    sockaddr_nl kernel = {};
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &request, sizeof(request), 0, (sockaddr*)&kernel, sizeof(kernel)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    thread_local vector<char> buffer(64 * 1024);
+    while (true) {
+        ssize_t n = recv(fd, buffer.data(), buffer.size(), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        int length = static_cast<int>(n);
+        for (auto* header = reinterpret_cast<nlmsghdr*>(buffer.data()); NLMSG_OK(header, length);
+             header = NLMSG_NEXT(header, length)) {
+            if (header->nlmsg_type == NLMSG_DONE) {
+                close(fd);
+                return true;
+            }
+            if (header->nlmsg_type == NLMSG_ERROR) {
+                close(fd);
+                return false;
+            }
+            if (header->nlmsg_type != SOCK_DIAG_BY_FAMILY) continue;
+
+            const auto* msg = static_cast<const inet_diag_msg*>(NLMSG_DATA(header));
+            Connection row = {};
+            row.family = msg->idiag_family;
+            row.protocol = table.protocol;
+            memcpy(row.local_address, msg->id.idiag_src, sizeof(row.local_address));
+            row.local_port = ntohs(msg->id.idiag_sport);
+            memcpy(row.remote_address, msg->id.idiag_dst, sizeof(row.remote_address));
+            row.remote_port = ntohs(msg->id.idiag_dport);
+            row.state = static_cast<TcpState>(msg->idiag_state);
+            row.inode = msg->idiag_inode;
+            on_row(row);
+        }
+    }
+
+    close(fd);
+    return false;
+}
+
+enum class NetstatBackend { Auto, Netlink, Proc };
+
+// Auto tries netlink first and drops to /proc for a table once its dump
+// fails (udp_diag may not be loaded while TCP works, for one). With a
+// PROC_ROOT other than /proc, Auto reads the tables there.
+NetstatBackend NETSTAT_BACKEND = NetstatBackend::Auto;
+uint32_t netlink_failed_tables = 0;
+
+// Calls on_row for every socket of one table whose state is in states,
+// using the selected backend.
+template <typename RowFn>
+bool for_each_socket_in(size_t table, RowFn&& on_row, uint32_t states) {
+    uint32_t bit = 1u << table;
+    if (NETSTAT_BACKEND == NetstatBackend::Netlink ||
+        (NETSTAT_BACKEND == NetstatBackend::Auto && !(netlink_failed_tables & bit) && PROC_ROOT == "/proc")) {
+        size_t rows = 0;
+        bool ok = for_each_socket_netlink(SOCKET_TABLES[table], [&](const Connection& row) {
+            rows++;
+            on_row(row);
+        }, states);
+        // Falling back after rows were already emitted would repeat them.
+        if (ok || rows > 0 || NETSTAT_BACKEND == NetstatBackend::Netlink) return ok;
+        netlink_failed_tables |= bit;
+    }
+    return for_each_socket_proc(SOCKET_TABLES[table], on_row, states);
+}
+
+// Calls on_row for every socket in the selected tables whose state is in
+// states. A table that can't be read at all (tcp6 with IPv6 disabled, say)
+// is skipped; false only if none could be read.
+template <typename RowFn>
+bool for_each_socket(RowFn&& on_row, uint32_t tables = ALL_SOCKET_TABLES, uint32_t states = TCP_ALL_STATES) {
+    bool any = false;
+    for (size_t table = 0; table < SOCKET_TABLES.size(); table++) {
+        if (tables & (1u << table)) any |= for_each_socket_in(table, on_row, states);
+    }
+    return any;
+}
+
+vector<Connection> getTCPConnections() {
+    vector<Connection> connections;
+    for_each_socket([&](const Connection& row) { connections.push_back(row); }, TCP_TABLES);
+    return connections;
+}
+
+/*
+The sockets seen by one netstat run over a set of tables, indexed by
+(protocol, local, remote, inode), the key the server uses too, so two runs
+can be diffed in linear time.
+*/
+class NetstatSnapshot {
+public:
+    explicit NetstatSnapshot(uint32_t tables = ALL_SOCKET_TABLES) : table_mask(tables) {}
+
+    void add(const Connection& row) { list.push_back(row); }
+
+    void build_index() {
+        index.build(list.size(), [&](size_t i) { return hash(list[i]); });
+    }
+
+    const Connection* find(const Connection& row) const {
+        long i = index.find(hash(row), [&](size_t i) { return same_socket(list[i], row); });
+        return i < 0 ? nullptr : &list[i];
+    }
+
+    const vector<Connection>& rows() const { return list; }
+    uint32_t tables() const { return table_mask; }
+
+private:
+    // Folds the two addresses, both ports and the inode into two words.
+    static size_t hash(const Connection& row) {
+        uint64_t local[2], remote[2];
+        memcpy(local, row.local_address, sizeof(local));
+        memcpy(remote, row.remote_address, sizeof(remote));
+        return mix_hash(local[0] ^ local[1] * 31 ^ (uint64_t(row.local_port) << 48 | row.inode),
+                        remote[0] ^ remote[1] * 31 ^ (uint64_t(row.remote_port) << 48));
+    }
+
+    static bool same_socket(const Connection& a, const Connection& b) {
+        return a.inode == b.inode && a.local_port == b.local_port && a.remote_port == b.remote_port &&
+               a.family == b.family && a.protocol == b.protocol && memcmp(a.local_address, b.local_address, sizeof(a.local_address)) == 0 &&
+               memcmp(a.remote_address, b.remote_address, sizeof(a.remote_address)) == 0;
+    }
+
+    uint32_t table_mask;
+    vector<Connection> list;
+    PositionIndex index;
+};
+
+DeltaTracker<NetstatSnapshot> netstat_deltas;
+
+// Rows are formatted on the stack as they are written.
+static void write_connection(ResultWriter& out, const Connection& row, bool with_state) {
+    char text[ADDRESS_TEXT_MAX];
+    out.begin_object();
+    out.key("Proto");
+    out.value(protocol_name(row));
+    out.key("Local");
+    out.value(local_text(text, row));
+    out.key("Remote");
+    out.value(remote_text(text, row));
+    if (with_state) {
+        out.key("State");
+        out.value(tcp_state_name(row.state));
+    }
+    out.key("Inode");
+    out.value(static_cast<int64_t>(row.inode));
+    out.end_object();
+}
+
+// A set of sockets, as row objects or as proto{}, local[], remote[],
+// state{} and inode[] columns.
+static void write_connections(ResultWriter& out, const vector<const Connection*>& rows, bool with_state) {
+    if (!columnar_results()) {
+        out.begin_array();
+        for (const Connection* row : rows) {
+            write_connection(out, *row, with_state);
+        }
+        out.end_array();
+        return;
+    }
+
+    char text[ADDRESS_TEXT_MAX];
+    out.begin_object();
+    write_dictionary_column(out, "proto", rows, [](const Connection* row) { return string_view(protocol_name(*row)); });
+    write_column(out, "local", rows, [&](const Connection* row) { return local_text(text, *row); });
+    write_column(out, "remote", rows, [&](const Connection* row) { return remote_text(text, *row); });
+    if (with_state) {
+        write_dictionary_column(out, "state", rows, [](const Connection* row) { return string_view(tcp_state_name(row->state)); });
+    }
+    write_column(out, "inode", rows, [](const Connection* row) { return static_cast<int64_t>(row->inode); });
+    out.end_object();
+}
+
+template <typename Filter>
+static vector<const Connection*> select_rows(const NetstatSnapshot& snapshot, Filter&& keep) {
+    vector<const Connection*> rows;
+    for (const Connection& row : snapshot.rows()) {
+        if (keep(row)) rows.push_back(&row);
+    }
+    return rows;
+}
+
+// Table mask for the arguments of a netstat task ("netstat tcp udp6");
+// every table when none is named.
+uint32_t netstat_tables(string_view arguments) {
+    uint32_t tables = 0;
+    while (!arguments.empty()) {
+        size_t space = arguments.find(' ');
+        string_view word = arguments.substr(0, space);
+        for (size_t table = 0; table < SOCKET_TABLES.size(); table++) {
+            if (word == SOCKET_TABLES[table].name) tables |= 1u << table;
+        }
+        arguments.remove_prefix(space == string_view::npos ? arguments.length() : space + 1);
+    }
+    return tables != 0 ? tables : ALL_SOCKET_TABLES;
+}
+
+/*
+Sends either a full keyframe of every socket in the selected tables or,
+when the server holds our previous snapshot of the same tables, a delta
+with only the sockets that were opened, closed or changed state since
+then. Sockets are keyed by (Local, Remote, Inode). Returns the seq of the
+snapshot staged for the result.
+*/
+uint32_t netstat_list(int task_id, int agent_id, ResultWriter& out, uint32_t tables = ALL_SOCKET_TABLES) {
+    lock_guard<mutex> collecting(netstat_deltas.collection_lock());
+    NetstatSnapshot current(tables);
+    for_each_socket([&](const Connection& row) { current.add(row); }, tables);
+    current.build_index();
+    auto previous = netstat_deltas.base();
+    const NetstatSnapshot* base = previous.snapshot.get();
+    if (base != nullptr && base->tables() != tables) base = nullptr;
+
+    write_task_header(out, task_id, agent_id, "netstat");
+    if (columnar_results()) {
+        out.key("layout");
+        out.value("columnar");
+    }
+    out.key("mode");
+    out.value(base ? "delta" : "full");
+    out.key("seq");
+    out.value(previous.seq + 1);
+
+    if (base == nullptr) {
+        out.key("results");
+        write_connections(out, select_rows(current, [](const Connection&) { return true; }), true);
+    } else {
+        out.key("base_seq");
+        out.value(previous.seq);
+        out.key("results");
+        out.begin_object();
+        out.key("opened");
+        write_connections(out, select_rows(current, [&](const Connection& row) { return base->find(row) == nullptr; }), true);
+        out.key("closed");
+        write_connections(out, select_rows(*base, [&](const Connection& row) { return current.find(row) == nullptr; }), false);
+        out.key("changed");
+        write_connections(out, select_rows(current, [&](const Connection& row) {
+            const Connection* old = base->find(row);
+            return old != nullptr && old->state != row.state;
+        }), true);
+        out.end_object();
+    }
+    out.end_object();
+
+    return netstat_deltas.stage(std::move(current), previous, base == nullptr);
+}
+
+
+
+
+
+/*
+END NETSAT FUNCTIONS
+*/
+
+
+
+
+/*
+PROCESS LIST FUNCTIONS
+*/
+
+// Layout of the records getdents64 fills in (not exported by glibc).
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+Holds an fd on a proc root and reads it with few syscalls: the directory is
+listed with large getdents64 batches and each <root>/<pid>/comm or stat is
+read with openat and a single pread into a buffer owned by the scanner.
+*/
+class ProcScanner {
+public:
+    ProcScanner() = default;
+    ~ProcScanner() {
+        if (proc_fd >= 0) close(proc_fd);
+    }
+
+    ProcScanner(const ProcScanner&) = delete;
+    ProcScanner& operator=(const ProcScanner&) = delete;
+
+    // (Re)opens the scanner on root, normally /proc.
+    void open_root(const string& root) {
+        if (proc_fd >= 0) close(proc_fd);
+        proc_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        opened_root = root;
+    }
+
+    bool is_open() const { return proc_fd >= 0; }
+    const string& root() const { return opened_root; }
+
+    // Appends the pid of every process directory in /proc.
+    bool list_pids(vector<int>& pids);
+
+    // The process name from /proc/<pid>/comm, valid until the next call.
+    // Empty if the process has exited.
+    string_view read_name(int pid);
+
+    // The name and start time (clock ticks after boot) from /proc/<pid>/stat.
+    // The name is valid until the next call. False if the process has exited.
+    bool read_process(int pid, string_view& name, uint64_t& start_time);
+
+private:
+    int read_file(int pid, const char* file, char* buffer, size_t size);
+
+    int proc_fd = -1;
+    string opened_root;
+    vector<char> dirents = vector<char>(64 * 1024);
+    char comm[64];
+    char stat[1024];
+};
+
+bool ProcScanner::list_pids(vector<int>& pids) {
+    if (proc_fd < 0 || lseek(proc_fd, 0, SEEK_SET) < 0) return false;
+
+    while (true) {
+        long n = syscall(SYS_getdents64, proc_fd, dirents.data(), dirents.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) return true;
+
+        for (long offset = 0; offset < n;) {
+            const auto* entry = reinterpret_cast<const linux_dirent64*>(dirents.data() + offset);
+            offset += entry->d_reclen;
+            if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) continue;
+
+            int pid = 0;
+            const char* c = entry->d_name;
+            for (; *c >= '0' && *c <= '9'; c++) pid = pid * 10 + (*c - '0');
+            if (*c == '\0' && pid > 0) pids.push_back(pid);
+        }
+    }
+}
+
+// Reads /proc/<pid>/<file> with one pread. Returns the byte count, or -1.
+int ProcScanner::read_file(int pid, const char* file, char* buffer, size_t size) {
+    char path[32];
+    char* end = to_chars(path, path + 16, pid).ptr;
+    *end++ = '/';
+    strcpy(end, file);
+
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, buffer, size, 0);
+    close(fd);
+    return static_cast<int>(n);
+}
+
+string_view ProcScanner::read_name(int pid) {
+    int n = read_file(pid, "comm", comm, sizeof(comm));
+    if (n <= 0) return {};
+    if (comm[n - 1] == '\n') n--;
+    return string_view(comm, n);
+}
+
+bool ProcScanner::read_process(int pid, string_view& name, uint64_t& start_time) {
+    int n = read_file(pid, "stat", stat, sizeof(stat));
+    if (n <= 0) return false;
+
+    // "1234 (name) S 1 ..." - the name may itself contain spaces and ')'.
+    const char* open_paren = static_cast<const char*>(memchr(stat, '(', n));
+    const char* close_paren = static_cast<const char*>(memrchr(stat, ')', n));
+    if (open_paren == nullptr || close_paren == nullptr || close_paren < open_paren) return false;
+    name = string_view(open_paren + 1, close_paren - open_paren - 1);
+
+    // starttime is field 22; field 3 starts two bytes after the ')'.
+    const char* p = close_paren + 2;
+    const char* end = stat + n;
+    for (int field = 3; field < 22 && p < end; field++) {
+        p = static_cast<const char*>(memchr(p, ' ', end - p));
+        if (p == nullptr) return false;
+        p++;
+    }
+    return from_chars(p, end, start_time).ec == errc();
+}
+
+// One scanner, and so one open fd on PROC_ROOT, per thread.
+ProcScanner& proc_scanner() {
+    thread_local ProcScanner scanner;
+    if (scanner.root() != PROC_ROOT) scanner.open_root(PROC_ROOT);
+    return scanner;
+}
+
+vector<int> get_pids(){
+    vector<int> pids;
+
+    if(!proc_scanner().list_pids(pids)){
+        cerr << "Error opening " << PROC_ROOT << " directory." << endl;
+    }
+    return pids;
+}
+
+string get_process_name(int pid){
+    return string(proc_scanner().read_name(pid));
+}
+
+
+// Threads used to read /proc/<pid>/stat in ps_list. 0 picks a quarter of
+// the cores; either way it is capped at PS_SCAN_MAX_WORKERS so a task never
+// takes over the host.
+int PS_SCAN_WORKERS = 0;
+const int PS_SCAN_MAX_WORKERS = 8;
+
+// PIDs handed out per unit of work. Below two chunks the scan stays serial.
+const size_t PS_SCAN_CHUNK = 256;
+
+int ps_scan_workers(size_t chunks) {
+    int workers = PS_SCAN_WORKERS > 0 ? PS_SCAN_WORKERS : static_cast<int>(thread::hardware_concurrency() / 4);
+    workers = min(workers, PS_SCAN_MAX_WORKERS);
+    return max(1, min(workers, static_cast<int>(chunks)));
+}
+
+/*
+One worker's share of the chunk indices. [begin, end) is packed into a
+single word so the owner, taking chunks from the front, and thieves, taking
+the back half, can both claim work with one CAS.
+*/
+class alignas(64) ChunkRange {
+public:
+    void reset(uint32_t begin, uint32_t end) { range.store(pack(begin, end)); }
+
+    bool pop_front(uint32_t& chunk) {
+        uint64_t current = range.load();
+        while (true) {
+            uint32_t begin = current >> 32, end = static_cast<uint32_t>(current);
+            if (begin >= end) return false;
+            if (range.compare_exchange_weak(current, pack(begin + 1, end))) {
+                chunk = begin;
+                return true;
+            }
+        }
+    }
+
+    bool steal_half(uint32_t& stolen_begin, uint32_t& stolen_end) {
+        uint64_t current = range.load();
+        while (true) {
+            uint32_t begin = current >> 32, end = static_cast<uint32_t>(current);
+            if (begin >= end) return false;
+            uint32_t middle = begin + (end - begin) / 2;
+            if (range.compare_exchange_weak(current, pack(begin, middle))) {
+                stolen_begin = middle;
+                stolen_end = end;
+                return true;
+            }
+        }
+    }
+
+private:
+    static uint64_t pack(uint32_t begin, uint32_t end) { return (static_cast<uint64_t>(begin) << 32) | end; }
+
+    atomic<uint64_t> range{0};
+};
+
+struct ProcessEntry {
+    int pid;
+    uint32_t name_offset;
+    uint64_t start_time;
+    uint32_t name_length;
+};
+
+/*
+The processes seen by one scan, in scan order, with names packed back to
+back in one string. After build_index() they can be looked up by (pid,
+start time), which is what lets two runs be diffed in linear time.
+*/
+class ProcessSnapshot {
+public:
+    void add(int pid, uint64_t start_time, string_view name) {
+        list.push_back({pid, static_cast<uint32_t>(names.size()), start_time, static_cast<uint32_t>(name.length())});
+        names += name;
+    }
+
+    void build_index();
+    const ProcessEntry* find(int pid, uint64_t start_time) const;
+
+    const vector<ProcessEntry>& entries() const { return list; }
+    string_view name(const ProcessEntry& entry) const {
+        return string_view(names).substr(entry.name_offset, entry.name_length);
+    }
+
+private:
+    vector<ProcessEntry> list;
+    string names;
+    PositionIndex index;
+};
+
+void ProcessSnapshot::build_index() {
+    index.build(list.size(), [&](size_t i) { return mix_hash(list[i].pid, list[i].start_time); });
+}
+
+const ProcessEntry* ProcessSnapshot::find(int pid, uint64_t start_time) const {
+    long i = index.find(mix_hash(pid, start_time), [&](size_t i) {
+        return list[i].pid == pid && list[i].start_time == start_time;
+    });
+    return i < 0 ? nullptr : &list[i];
+}
+
+// Where the entries for one chunk ended up: which worker, which slice.
+struct ChunkResult {
+    uint32_t worker;
+    uint32_t first;
+    uint32_t last;
+};
+
+/*
+Helper threads for scan_processes. They are started the first time a scan
+needs them and then wait for the next scan, so a scan only wakes threads
+instead of creating and joining them on every ps_list. One scan runs at a
+time: run() hands work(1..helpers) to the pool, does work(0) on the calling
+thread and returns once every part is done.
+*/
+class ScanPool {
+public:
+    ScanPool() = default;
+    ~ScanPool();
+
+    ScanPool(const ScanPool&) = delete;
+    ScanPool& operator=(const ScanPool&) = delete;
+
+    void run(int helpers, const function<void(int)>& work);
+
+private:
+    void serve(int index);
+
+    mutex scanning;  // held for a whole run()
+    mutex state;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)>* job = nullptr;
+    uint64_t generation = 0;  // bumped for every job
+    int wanted = 0;           // helpers taking part in the job
+    int running = 0;          // of those, still working
+    bool stopping = false;
+    vector<thread> threads;
+};
+
+ScanPool::~ScanPool() {
+    {
+        lock_guard<mutex> lock(state);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads) t.join();
+}
+
+void ScanPool::run(int helpers, const function<void(int)>& work) {
+    lock_guard<mutex> scan(scanning);
+    {
+        lock_guard<mutex> lock(state);
+        while (static_cast<int>(threads.size()) < helpers) {
+            threads.emplace_back(&ScanPool::serve, this, static_cast<int>(threads.size()) + 1);
+        }
+        job = &work;
+        wanted = running = helpers;
+        generation++;
+    }
+    wake.notify_all();
+    work(0);
+
+    unique_lock<mutex> lock(state);
+    done.wait(lock, [&] { return running == 0; });
+    job = nullptr;
+}
+
+void ScanPool::serve(int index) {
+    uint64_t seen = 0;
+    unique_lock<mutex> lock(state);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        if (index > wanted) continue;
+        const function<void(int)>& work = *job;
+        lock.unlock();
+        work(index);
+        lock.lock();
+        if (--running == 0) done.notify_one();
+    }
+}
+
+ScanPool& scan_pool() {
+    static ScanPool pool;
+    return pool;
+}
+
+/*
+Reads the name and start time of pids on up to `workers` threads (the
+caller's and scan_pool()'s) with work stealing, then calls on_process(pid,
+start_time, name) for every pid still running, in the original order.
+*/
+template <typename ProcessFn>
+void scan_processes(const vector<int>& pids, int workers, ProcessFn&& on_process) {
+    uint32_t chunks = static_cast<uint32_t>((pids.size() + PS_SCAN_CHUNK - 1) / PS_SCAN_CHUNK);
+    vector<ChunkRange> ranges(workers);
+    vector<ProcessSnapshot> buffers(workers);
+    vector<ChunkResult> results(chunks);
+
+    for (int w = 0; w < workers; w++) {
+        ranges[w].reset(static_cast<uint32_t>(uint64_t(chunks) * w / workers),
+                        static_cast<uint32_t>(uint64_t(chunks) * (w + 1) / workers));
+    }
+
+    function<void(int)> work = [&](int me) {
+        ProcScanner& scanner = proc_scanner();
+        ProcessSnapshot& buffer = buffers[me];
+        while (true) {
+            uint32_t chunk;
+            if (!ranges[me].pop_front(chunk)) {
+                bool stolen = false;
+                for (int k = 1; k < workers && !stolen; k++) {
+                    uint32_t begin, end;
+                    if (ranges[(me + k) % workers].steal_half(begin, end)) {
+                        ranges[me].reset(begin, end);
+                        stolen = true;
+                    }
+                }
+                if (!stolen) return;
+                continue;
+            }
+
+            ChunkResult& result = results[chunk];
+            result.worker = me;
+            result.first = static_cast<uint32_t>(buffer.entries().size());
+            size_t end = min(pids.size(), (chunk + 1) * PS_SCAN_CHUNK);
+            for (size_t i = chunk * PS_SCAN_CHUNK; i < end; i++) {
+                string_view name;
+                uint64_t start_time;
+                if (scanner.read_process(pids[i], name, start_time)) buffer.add(pids[i], start_time, name);
+            }
+            result.last = static_cast<uint32_t>(buffer.entries().size());
+        }
+    };
+
+    scan_pool().run(workers - 1, work);
+
+    for (const ChunkResult& result : results) {
+        const ProcessSnapshot& buffer = buffers[result.worker];
+        for (uint32_t i = result.first; i < result.last; i++) {
+            const ProcessEntry& entry = buffer.entries()[i];
+            on_process(entry.pid, entry.start_time, buffer.name(entry));
+        }
+    }
+}
+
+// Snapshot of every running process, indexed for diffing.
+ProcessSnapshot collect_processes() {
+    ProcScanner& scanner = proc_scanner();
+    thread_local std::vector<int> pids;
+    pids.clear();
+    if(!scanner.list_pids(pids)){
+        cerr << "Error opening " << PROC_ROOT << " directory." << endl;
+    }
+
+    ProcessSnapshot snapshot;
+    int workers = ps_scan_workers((pids.size() + PS_SCAN_CHUNK - 1) / PS_SCAN_CHUNK);
+    if(workers > 1){
+        scan_processes(pids, workers, [&](int pid, uint64_t start_time, string_view name) {
+            snapshot.add(pid, start_time, name);
+        });
+    }
+    else {
+        for(int pid: pids){
+            string_view name;
+            uint64_t start_time;
+            if(scanner.read_process(pid, name, start_time)){
+                snapshot.add(pid, start_time, name);
+            }
+        }
+    }
+    snapshot.build_index();
+    return snapshot;
+}
+
+DeltaTracker<ProcessSnapshot> process_deltas;
+
+static void write_process(ResultWriter& out, const ProcessSnapshot& snapshot, const ProcessEntry& entry, bool with_name) {
+    out.begin_object();
+    out.key("PID");
+    out.value(entry.pid);
+    out.key("Start");
+    out.value(static_cast<int64_t>(entry.start_time));
+    if (with_name) {
+        out.key("Name");
+        out.value(snapshot.name(entry));
+    }
+    out.end_object();
+}
+
+// A set of processes, as row objects or as pid[], start[] and name{} columns.
+static void write_processes(ResultWriter& out, const ProcessSnapshot& snapshot,
+                            const vector<const ProcessEntry*>& entries, bool with_name) {
+    if (!columnar_results()) {
+        out.begin_array();
+        for (const ProcessEntry* entry : entries) {
+            write_process(out, snapshot, *entry, with_name);
+        }
+        out.end_array();
+        return;
+    }
+
+    out.begin_object();
+    write_column(out, "pid", entries, [](const ProcessEntry* entry) { return static_cast<int64_t>(entry->pid); });
+    write_column(out, "start", entries, [](const ProcessEntry* entry) { return static_cast<int64_t>(entry->start_time); });
+    if (with_name) {
+        write_dictionary_column(out, "name", entries, [&](const ProcessEntry* entry) { return snapshot.name(*entry); });
+    }
+    out.end_object();
+}
+
+template <typename Filter>
+static vector<const ProcessEntry*> select_processes(const ProcessSnapshot& snapshot, Filter&& keep) {
+    vector<const ProcessEntry*> entries;
+    for (const ProcessEntry& entry : snapshot.entries()) {
+        if (keep(entry)) entries.push_back(&entry);
+    }
+    return entries;
+}
+
+/*
+Sends either a full keyframe ("mode": "full", every process) or, when the
+server holds our previous snapshot, a delta against it ("mode": "delta")
+listing only the processes that were added, exited or renamed. Processes
+are keyed by (PID, Start) so a reused pid shows up as exit + add. Returns
+the seq of the snapshot staged for the result.
+*/
+uint32_t ps_list(int task_id, int agent_id, ResultWriter& out){
+    lock_guard<mutex> collecting(process_deltas.collection_lock());
+    ProcessSnapshot current = collect_processes();
+    auto previous = process_deltas.base();
+    const ProcessSnapshot* base = previous.snapshot.get();
+
+    write_task_header(out, task_id, agent_id, "process_list");
+    if(columnar_results()){
+        out.key("layout");
+        out.value("columnar");
+    }
+    out.key("mode");
+    out.value(base ? "delta" : "full");
+    out.key("seq");
+    out.value(previous.seq + 1);
+
+    if(base == nullptr){
+        out.key("results");
+        write_processes(out, current, select_processes(current, [](const ProcessEntry&) { return true; }), true);
+    }
+    else {
+        out.key("base_seq");
+        out.value(previous.seq);
+        out.key("results");
+        out.begin_object();
+        out.key("added");
+        write_processes(out, current, select_processes(current, [&](const ProcessEntry& entry) {
+            return base->find(entry.pid, entry.start_time) == nullptr;
+        }), true);
+        out.key("exited");
+        write_processes(out, *base, select_processes(*base, [&](const ProcessEntry& entry) {
+            return current.find(entry.pid, entry.start_time) == nullptr;
+        }), false);
+        out.key("renamed");
+        write_processes(out, current, select_processes(current, [&](const ProcessEntry& entry) {
+            const ProcessEntry* old = base->find(entry.pid, entry.start_time);
+            return old != nullptr && base->name(*old) != current.name(entry);
+        }), true);
+        out.end_object();
+    }
+    out.end_object();
+
+    return process_deltas.stage(std::move(current), previous, base == nullptr);
+}
+
+
+/*
+END PROCESS LIST FUNCTIONS
+*/
+
+/*
+NETWORKING FUNCTIONS
+
+*/
+
+// Longest a connect may take, and longest a whole request may take from
+// connect to the end of the response (plus any time the server is asked to
+// hold it, see ServerConnection::request), before it counts as failed.
+int CONNECT_TIMEOUT_MS = 5000;
+int IO_TIMEOUT_MS = 30000;
+
+// A failed request is tried REQUEST_ATTEMPTS times in all. The wait before
+// a retry starts at RETRY_BACKOFF_MS and doubles up to RETRY_BACKOFF_MAX_MS,
+// with jitter so agents that lost the server together don't return together.
+int REQUEST_ATTEMPTS = 3;
+int RETRY_BACKOFF_MS = 500;
+int RETRY_BACKOFF_MAX_MS = 30000;
+
+int create_socket() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        cerr << "Error creating socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    // Requests go out in whole pieces already; Nagle would only hold back
+    // the small tail of a chunked body until the server's delayed ACK.
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+sockaddr_in setup_server_address(const char* server_host, int server_port) {
+    sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    inet_pton(AF_INET, server_host, &server_address.sin_addr);
+    server_address.sin_port = htons(server_port);
+    return server_address;
+}
+
+/*
+Non-blocking TCP connection with an epoll instance of its own. The socket is
+registered edge-triggered for both directions once, and a send or receive
+only waits in epoll after the kernel said EAGAIN, until the deadline set
+for the request. Every failure, running past the deadline included
+(ETIMEDOUT), comes back as false or -1 with errno set instead of blocking
+the agent.
+*/
+class Socket {
+public:
+    Socket() = default;
+    ~Socket() { close(); }
+
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    bool connect(const sockaddr_in& address);
+    void close();
+    bool is_open() const { return fd >= 0; }
+    bool is_stale() const;
+
+    // Connects, sends and receives from now on fail once deadline passes,
+    // however much progress each makes on the way.
+    void set_deadline(chrono::steady_clock::time_point deadline) { this->deadline = deadline; }
+
+    bool send(string_view data);
+    bool send(msghdr& message);
+    // Bytes received, 0 once the server has closed, -1 on error or when
+    // the deadline passed before anything arrived.
+    ssize_t receive(char* data, size_t size);
+
+private:
+    bool wait(uint32_t events, chrono::steady_clock::time_point until);
+
+    int fd = -1;
+    int epoll_fd = -1;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+};
+
+bool Socket::connect(const sockaddr_in& address) {
+    close();
+    fd = create_socket();
+    if (fd < 0) return false;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event interest = {};
+    interest.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &interest) < 0) {
+        int error = errno;
+        close();
+        errno = error;
+        return false;
+    }
+
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) return true;
+    auto connect_deadline = min(deadline, chrono::steady_clock::now() + chrono::milliseconds(CONNECT_TIMEOUT_MS));
+    if (errno == EINPROGRESS && wait(EPOLLOUT, connect_deadline)) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0) return true;
+        errno = error;
+    }
+    int error = errno;
+    close();
+    errno = error;
+    return false;
+}
+
+void Socket::close() {
+    if (fd >= 0) ::close(fd);
+    if (epoll_fd >= 0) ::close(epoll_fd);
+    fd = -1;
+    epoll_fd = -1;
+}
+
+// An idle keep-alive socket should have nothing to read. If it polls readable
+// the server has either closed it or sent something we never asked for.
+bool Socket::is_stale() const {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) <= 0) return false;
+    char c;
+    return (pfd.revents & (POLLERR | POLLHUP)) || recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+// Waits until the socket reports one of events, an error or a hangup.
+// Fails with ETIMEDOUT once until has passed.
+bool Socket::wait(uint32_t events, chrono::steady_clock::time_point until) {
+    while (true) {
+        auto now = chrono::steady_clock::now();
+        int64_t left = until > now ? chrono::ceil<chrono::milliseconds>(until - now).count() : 0;
+        left = min<int64_t>(left, INT_MAX);
+        epoll_event event;
+        int n = epoll_wait(epoll_fd, &event, 1, static_cast<int>(left));
+        if (n < 0 && errno != EINTR) return false;
+        if (n > 0 && (event.events & (events | EPOLLERR | EPOLLHUP | EPOLLRDHUP))) return true;
+        if (n == 0 && left == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+    }
+}
+
+// Sends all of data. MSG_NOSIGNAL so a connection the server already
+// closed shows up as an error here instead of killing us with SIGPIPE.
+bool Socket::send(string_view data) {
+    iovec part = {const_cast<char*>(data.data()), data.length()};
+    msghdr message = {};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    return send(message);
+}
+
+// Sends every buffer of the message, advancing the iovecs as it goes.
+bool Socket::send(msghdr& message) {
+    while (message.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && wait(EPOLLOUT, deadline)) continue;
+            return false;
+        }
+        while (message.msg_iovlen > 0 && static_cast<size_t>(n) >= message.msg_iov->iov_len) {
+            n -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = static_cast<char*>(message.msg_iov->iov_base) + n;
+            message.msg_iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+ssize_t Socket::receive(char* data, size_t size) {
+    while (true) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN && wait(EPOLLIN, deadline)) continue;
+        return -1;
+    }
+}
+
+/*
+Incremental HTTP/1.1 response reader. Bytes are received straight into one
+reusable buffer and parsed as they arrive (status line, headers, then a
+Content-Length or chunked body), so read() returns as soon as the response
+is complete and the connection can be reused. The body is handed out as a
+view into the buffer; chunked bodies are joined in place. Anything the
+server sent past the end of the response is kept for the next read().
+*/
+struct HttpResponse {
+    int status = 0;  // 0 when no response arrived at all
+    bool keep_alive = true;
+    string_view body;  // valid until the next read() on the same reader
+};
+
+class HttpResponseReader {
+public:
+    // Reads one full response by the socket's deadline. Returns false if
+    // the connection failed or closed early, the deadline passed, or the
+    // response was malformed.
+    bool read(Socket& sock, HttpResponse& response);
+    // Whether any of the response being read has arrived yet.
+    bool started() const { return length > 0; }
+
+private:
+    enum class State { StatusLine, Headers, Body, ChunkSize, ChunkData, ChunkEnd, Trailers, UntilClose, Done };
+    enum class Result { NeedMore, Done, Error };
+
+    static constexpr size_t READ_SIZE = 16 * 1024;
+    static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+
+    void reset();
+    Result parse();
+    bool next_line(string_view& line);
+    bool parse_status_line(string_view line);
+    void parse_header(string_view line);
+
+    vector<char> buffer;
+    size_t length = 0;        // bytes of buffer holding received data
+    size_t pos = 0;           // parse cursor
+    size_t body_begin = 0;
+    size_t body_end = 0;      // end of the (de-chunked) body so far
+    size_t content_length = 0;
+    size_t chunk_remaining = 0;
+    bool has_length = false;
+    bool chunked = false;
+    int status = 0;
+    bool keep_alive = true;
+    State state = State::StatusLine;
+};
+
+static bool iequals(string_view a, string_view b) {
+    return a.length() == b.length() && strncasecmp(a.data(), b.data(), a.length()) == 0;
+}
+
+static string_view trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// Drops the previous response but keeps any bytes that followed it.
+void HttpResponseReader::reset() {
+    if (pos > 0) {
+        memmove(buffer.data(), buffer.data() + pos, length - pos);
+        length -= pos;
+    }
+    pos = body_begin = body_end = 0;
+    content_length = chunk_remaining = 0;
+    has_length = chunked = false;
+    status = 0;
+    keep_alive = true;
+    state = State::StatusLine;
+}
+
+bool HttpResponseReader::next_line(string_view& line) {
+    const char* start = buffer.data() + pos;
+    const char* end = static_cast<const char*>(memchr(start, '\n', length - pos));
+    if (end == nullptr) return false;
+    size_t line_length = end - start;
+    pos += line_length + 1;
+    if (line_length > 0 && start[line_length - 1] == '\r') line_length--;
+    line = string_view(start, line_length);
+    return true;
+}
+
+bool HttpResponseReader::parse_status_line(string_view line) {
+    // HTTP/1.1 200 OK
+    if (line.length() < 12 || line.compare(0, 5, "HTTP/") != 0 || line[8] != ' ') return false;
+    if (line.compare(5, 3, "1.0") == 0) keep_alive = false;
+    auto result = from_chars(line.data() + 9, line.data() + 12, status);
+    return result.ec == errc() && result.ptr == line.data() + 12;
+}
+
+void HttpResponseReader::parse_header(string_view line) {
+    size_t colon = line.find(':');
+    if (colon == string_view::npos) return;
+    string_view name = line.substr(0, colon);
+    string_view value = trim(line.substr(colon + 1));
+
+    if (iequals(name, "Content-Length")) {
+        has_length = from_chars(value.data(), value.data() + value.length(), content_length).ec == errc();
+    } else if (iequals(name, "Transfer-Encoding")) {
+        size_t comma = value.rfind(',');
+        chunked = iequals(trim(comma == string_view::npos ? value : value.substr(comma + 1)), "chunked");
+    } else if (iequals(name, "Connection")) {
+        if (iequals(value, "close")) keep_alive = false;
+        else if (iequals(value, "keep-alive")) keep_alive = true;
+    }
+}
+
+HttpResponseReader::Result HttpResponseReader::parse() {
+    string_view line;
+    while (true) {
+        switch (state) {
+        case State::StatusLine:
+            if (!next_line(line)) return length - pos > MAX_HEADER_SIZE ? Result::Error : Result::NeedMore;
+            if (!parse_status_line(line)) return Result::Error;
+            state = State::Headers;
+            break;
+
+        case State::Headers:
+            if (!next_line(line)) return length - pos > MAX_HEADER_SIZE ? Result::Error : Result::NeedMore;
+            if (!line.empty()) {
+                parse_header(line);
+                break;
+            }
+            if (status / 100 == 1) {
+                // Interim response (100 Continue), the real one follows.
+                has_length = chunked = false;
+                state = State::StatusLine;
+                break;
+            }
+            body_begin = body_end = pos;
+            if (status == 204 || status == 304) state = State::Done;
+            else if (chunked) state = State::ChunkSize;
+            else if (has_length) state = State::Body;
+            else state = State::UntilClose;
+            break;
+
+        case State::Body:
+            if (length - body_begin < content_length) return Result::NeedMore;
+            body_end = pos = body_begin + content_length;
+            state = State::Done;
+            break;
+
+        case State::ChunkSize: {
+            if (!next_line(line)) return Result::NeedMore;
+            size_t semicolon = line.find(';');  // chunk extensions are ignored
+            string_view size = trim(line.substr(0, semicolon));
+            auto result = from_chars(size.data(), size.data() + size.length(), chunk_remaining, 16);
+            if (size.empty() || result.ec != errc() || result.ptr != size.data() + size.length()) return Result::Error;
+            state = chunk_remaining == 0 ? State::Trailers : State::ChunkData;
+            break;
+        }
+
+        case State::ChunkData: {
+            size_t take = min(length - pos, chunk_remaining);
+            if (body_end != pos) memmove(buffer.data() + body_end, buffer.data() + pos, take);
+            body_end += take;
+            pos += take;
+            chunk_remaining -= take;
+            if (chunk_remaining > 0) return Result::NeedMore;
+            state = State::ChunkEnd;
+            break;
+        }
+
+        case State::ChunkEnd:
+            if (!next_line(line)) return Result::NeedMore;
+            if (!line.empty()) return Result::Error;
+            state = State::ChunkSize;
+            break;
+
+        case State::Trailers:
+            if (!next_line(line)) return Result::NeedMore;
+            if (line.empty()) state = State::Done;
+            break;
+
+        case State::UntilClose:
+            body_end = pos = length;
+            return Result::NeedMore;
+
+        case State::Done:
+            return Result::Done;
+        }
+    }
+}
+
+bool HttpResponseReader::read(Socket& sock, HttpResponse& response) {
+    reset();
+    while (true) {
+        Result result = parse();
+        if (result == Result::Error) {
+            errno = EPROTO;
+            return false;
+        }
+        if (result == Result::Done) break;
+
+        if (buffer.size() - length < READ_SIZE) {
+            buffer.resize(max(buffer.size() * 2, length + READ_SIZE));
+        }
+        ssize_t bytes_received = sock.receive(buffer.data() + length, buffer.size() - length);
+        if (bytes_received <= 0) {
+            // A body without Content-Length or chunking runs until close.
+            if (bytes_received < 0) return false;
+            if (state != State::UntilClose) {
+                errno = ECONNRESET;  // closed before the response was complete
+                return false;
+            }
+            keep_alive = false;
+            break;
+        }
+        length += bytes_received;
+    }
+
+    response.status = status;
+    response.keep_alive = keep_alive;
+    response.body = string_view(buffer.data() + body_begin, body_end - body_begin);
+    return true;
+}
+
+string build_request(const string& method, const string& endpoint, const string& body) {
+    string request = method + " " + endpoint + " HTTP/1.1\r\n";
+    request += "Host: 127.0.0.1\r\n";
+    request += "Connection: keep-alive\r\n";
+    if (method != "GET") {
+        request += "Content-Type: application/json\r\n";
+        request += "Content-Length: " + to_string(body.length()) + "\r\n";
+    }
+    request += "\r\n";  // Headers end
+    request += body;    // Request body
+    return request;
+}
+
+/*
+Holds one HTTP/1.1 keep-alive connection to the server and reuses it for the
+beacon, poll and result uploads of every cycle. Each attempt at a request
+has IO_TIMEOUT_MS in all. When the server turns out to have closed a reused
+connection before it could see the request (the send failed, or the
+connection was reset before any of the response came back), the request is
+replayed once, at once, on a new socket. Any other failure, a timeout
+included, is retried with backoff (see REQUEST_ATTEMPTS); once the attempts
+are used up the request returns status 0.
+*/
+class ServerConnection {
+public:
+    explicit ServerConnection(const sockaddr_in& server_address) : server_address(server_address) {}
+
+    ServerConnection(const ServerConnection&) = delete;
+    ServerConnection& operator=(const ServerConnection&) = delete;
+
+    // The returned body stays valid until the next request. hold_ms is how
+    // long the server may sit on the request on purpose (long polling); it
+    // is added to the IO_TIMEOUT_MS deadline.
+    HttpResponse request(const string& method, const string& endpoint, const string& body = "", int hold_ms = 0);
+
+    // POSTs a body produced on the fly in the given encoding, sent with
+    // chunked transfer encoding as the writer flushes (see UploadBody), and
+    // gzip-compressed if compress is set. produce is run again for every
+    // retry.
+    HttpResponse stream(const string& endpoint, ResultEncoding encoding,
+                        const function<void(ResultWriter&)>& produce, bool compress = false);
+    void disconnect();
+
+private:
+    HttpResponse exchange(const string& endpoint, const function<bool()>& send_body, int hold_ms = 0);
+
+    sockaddr_in server_address;
+    Socket sock;
+    HttpResponseReader reader;
 };
 
-string parseAddress(const string& addr) {
-    stringstream ss;
-    unsigned int ip[4], port;
+void ServerConnection::disconnect() {
+    sock.close();
+}
 
-    sscanf(addr.c_str(), "%02X%02X%02X%02X:%04X", &ip[3], &ip[2], &ip[1], &ip[0], &port);
-    ss << ip[0] << "." << ip[1] << "." << ip[2] << "." << ip[3] << ":" << port;
+// Wait before retry number attempt (1 for the first): exponential, with
+// the second half of each step picked at random.
+static chrono::milliseconds retry_backoff(int attempt) {
+    thread_local mt19937 generator(random_device{}());
+    int64_t step = RETRY_BACKOFF_MS;
+    for (int i = 1; i < attempt && step < RETRY_BACKOFF_MAX_MS; i++) step *= 2;
+    step = min<int64_t>(step, RETRY_BACKOFF_MAX_MS);
+    return chrono::milliseconds(uniform_int_distribution<int64_t>(step / 2, step)(generator));
+}
+
+HttpResponse ServerConnection::exchange(const string& endpoint, const function<bool()>& send_body, int hold_ms) {
+    HttpResponse response;
 
-    return ss.str();
+    int attempt = 1;
+    while (true) {
+        if (sock.is_open() && sock.is_stale()) {
+            disconnect();
+        }
+        bool reused = sock.is_open();
+        sock.set_deadline(chrono::steady_clock::now() + chrono::milliseconds(IO_TIMEOUT_MS + hold_ms));
+        bool sent = (reused || sock.connect(server_address)) && send_body();
+        if (sent && reader.read(sock, response)) {
+            if (!response.keep_alive) disconnect();
+            return response;
+        }
+        int error = errno;
+        // The server dropped an idle connection. Anything else, a timeout
+        // above all, may mean it has the request already.
+        bool dropped = reused && (error == EPIPE || error == ECONNRESET) && (!sent || !reader.started());
+        disconnect();
+        reader = HttpResponseReader();
+        if (dropped) continue;  // on a new socket, so only once
+
+        cerr << "Request to " << endpoint << " failed: " << strerror(error)
+             << " (attempt " << attempt << " of " << REQUEST_ATTEMPTS << ")" << endl;
+        if (attempt >= REQUEST_ATTEMPTS) return HttpResponse();
+        this_thread::sleep_for(retry_backoff(attempt++));
+    }
 }
 
+HttpResponse ServerConnection::request(const string& method, const string& endpoint, const string& body, int hold_ms) {
+    string request = build_request(method, endpoint, body);
+    return exchange(endpoint, [&] { return sock.send(request); }, hold_ms);
+}
 
-string getState(const string& hexState) {
-    int state;
-    stringstream ss;
-    ss << hex << hexState;
-    ss >> state;
-
-    switch (state) {
-        case 1: return "ESTABLISHED";
-        case 2: return "SYN_SENT";
-        case 3: return "SYN_RECV";
-        case 4: return "FIN_WAIT1";
-        case 5: return "FIN_WAIT2";
-        case 6: return "TIME_WAIT";
-        case 7: return "CLOSE";
-        case 8: return "CLOSE_WAIT";
-        case 9: return "LAST_ACK";
-        case 10: return "LISTEN";
-        case 11: return "CLOSING";
-        default: return "UNKNOWN";
+// Sends one chunk of a chunked request body: size line, data, CRLF.
+bool send_chunk(Socket& sock, string_view data) {
+    char size_line[20];
+    char* end = to_chars(size_line, size_line + 16, data.length(), 16).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+
+    iovec parts[3] = {
+        {size_line, static_cast<size_t>(end - size_line)},
+        {const_cast<char*>(data.data()), data.length()},
+        {const_cast<char*>("\r\n"), 2},
+    };
+    msghdr message = {};
+    message.msg_iov = parts;
+    message.msg_iovlen = 3;
+    return sock.send(message);
+}
+
+// Streamed uploads are held back until this many bytes have been produced.
+// A body that ends before then is sent raw with a Content-Length; a longer
+// one is gzip-compressed when the server accepts it.
+size_t COMPRESS_THRESHOLD = 32 * 1024;
+// zlib level for compressed uploads, 1 (fastest) to 9 (smallest). 0 turns
+// compression off.
+int COMPRESS_LEVEL = 1;
+
+/*
+Body of a streamed upload. The first COMPRESS_THRESHOLD bytes are buffered
+so the framing can be picked once the size is known to be small or not:
+small bodies go out in one piece with a Content-Length, larger ones in
+chunks, deflated into gzip on the way if compress is set.
+*/
+class UploadBody {
+public:
+    UploadBody(Socket& sock, string head, bool compress)
+        : sock(sock), head(std::move(head)), compress(compress && COMPRESS_LEVEL > 0) {}
+    ~UploadBody() {
+        if (deflating) deflateEnd(&zs);
+    }
+
+    UploadBody(const UploadBody&) = delete;
+    UploadBody& operator=(const UploadBody&) = delete;
+
+    bool write(string_view data);
+    bool finish();
+
+private:
+    bool start_chunked();
+    bool deflate_chunks(string_view data, int flush);
+
+    Socket& sock;
+    string head;
+    bool compress;
+    bool started = false;
+    bool deflating = false;
+    string pending;
+    z_stream zs = {};
+    vector<char> deflated;
+};
+
+bool UploadBody::write(string_view data) {
+    if (!started) {
+        pending.append(data);
+        if (pending.length() < COMPRESS_THRESHOLD) return true;
+        return start_chunked();
     }
+    return deflating ? deflate_chunks(data, Z_NO_FLUSH) : send_chunk(sock, data);
 }
 
-vector<Connection> getTCPConnections() {
-    vector<Connection> connections;
-    ifstream file("/proc/net/tcp");
-    string line;
+bool UploadBody::finish() {
+    if (!started) {
+        head += "Content-Length: " + to_string(pending.length()) + "\r\n\r\n";
+        head += pending;
+        return sock.send(head);
+    }
+    if (deflating && !deflate_chunks({}, Z_FINISH)) return false;
+    return sock.send("0\r\n\r\n");
+}
+
+bool UploadBody::start_chunked() {
+    started = true;
+    // windowBits 15 + 16 asks zlib for a gzip wrapper instead of a zlib one
+    if (compress && deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+        deflating = true;
+        deflated.resize(64 * 1024);
+        head += "Content-Encoding: gzip\r\n";
+    }
+    head += "Transfer-Encoding: chunked\r\n\r\n";
+    if (!sock.send(head)) return false;
+
+    string body;
+    body.swap(pending);
+    return deflating ? deflate_chunks(body, Z_NO_FLUSH) : send_chunk(sock, body);
+}
 
-    // Skip the header line
-    getline(file, line);
+// Feeds data to the deflate stream and sends every full output buffer as a
+// chunk. With Z_FINISH the stream is ended and the tail is sent too.
+bool UploadBody::deflate_chunks(string_view data, int flush) {
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.length();
+    int status;
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(deflated.data());
+        zs.avail_out = deflated.size();
+        status = deflate(&zs, flush);
+        if (status == Z_STREAM_ERROR) return false;
+        size_t produced = deflated.size() - zs.avail_out;
+        if (produced > 0 && !send_chunk(sock, string_view(deflated.data(), produced))) return false;
+    } while (zs.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    return true;
+}
 
-    while (getline(file, line)) {
-        stringstream ss(line);
-        string tmp, local_address, remote_address, state;
+HttpResponse ServerConnection::stream(const string& endpoint, ResultEncoding encoding,
+                                      const function<void(ResultWriter&)>& produce, bool compress) {
+    string head = "POST " + endpoint + " HTTP/1.1\r\n";
+    head += "Host: 127.0.0.1\r\n";
+    head += "Connection: keep-alive\r\n";
+    head += encoding == ResultEncoding::Cbor ? "Content-Type: application/cbor\r\n" : "Content-Type: application/json\r\n";
+
+    return exchange(endpoint, [&] {
+        UploadBody body(sock, head, compress);
+        ResultWriter out([&body](string_view data) { return body.write(data); }, encoding);
+        produce(out);
+        return out.flush() && body.finish();
+    });
+}
 
-        ss >> tmp; // Skip the sl field
-        ss >> local_address;
-        ss >> remote_address;
-        ss >> state;
+int newAgent(ServerConnection& conn, string ip, string mac){
+    nlohmann::json newAgentData;
+    newAgentData["ip"] = ip;
+    newAgentData["mac"] = mac;
 
-        Connection conn;
-        conn.local_address = parseAddress(local_address);
-        conn.remote_address = parseAddress(remote_address);
-        conn.state = getState(state);
+    string body = newAgentData.dump();  
+    
+    string endpoint = "/api/new_agent";
+    HttpResponse response = conn.request("POST", endpoint, body);
+    
 
-        connections.push_back(conn);
+    if (response.status == 0) {
+        std::cerr << "Could not reach server to register agent" << std::endl;
+        return -1;
+    }
+    if (response.status / 100 != 2) {
+        std::cerr << "Server refused new agent: HTTP " << response.status << std::endl;
+        return -1;
+    }
+    try {
+        nlohmann::json jsonResponse = nlohmann::json::parse(response.body);
+        int agentID = jsonResponse["id"];
+        return agentID;
+    } catch (const std::exception& e) {
+        std::cerr << "Error parsing JSON: " << e.what() << std::endl;
+        return -1;
     }
+}
 
-    return connections;
+// How long a check-in asks the server to hold on to it while the agent has
+// no tasks, so a new task is handed over the moment it is added. Servers
+// that hold the request say so with "long_poll" and the agent checks in
+// again right away; 0 turns long polling off. Servers hold idle agents for
+// up to their idle check-in interval, so this covers a minute.
+int LONG_POLL_SECONDS = 60;
+
+HttpResponse pollServer(ServerConnection& conn, int agentID){
+    string endpoint = "/api/agent/tasks/pending/" + std::to_string(agentID);
+    if (LONG_POLL_SECONDS > 0) endpoint += "?wait=" + std::to_string(LONG_POLL_SECONDS);
+    HttpResponse response = conn.request("GET", endpoint, "", LONG_POLL_SECONDS * 1000);
+    //cout << "Received Data: \n" << response.body << endl;
+    return response;
 }
 
-nlohmann::json netstat_list(int task_id, int agent_id) {
-    // JSON building
-    nlohmann::json task_json;
-    task_json["task_id"] = task_id;
-    task_json["agent_id"] = agent_id;
-    task_json["command"] = "netstat";
+void beacon(ServerConnection& conn, int agentID){
+    nlohmann::json beaconData;
+    beaconData["agent_id"] = agentID;
+
+    string body = beaconData.dump();  
+    
+    string endpoint = "/api/beacon";
+    conn.request("POST", endpoint, body);
+}
 
-    vector<Connection> connections = getTCPConnections();
-    nlohmann::json results = nlohmann::json::array();
+// Set once the server turns out not to have the combined check-in endpoint.
+bool legacy_checkin = false;
 
-    for (const auto& conn : connections) {
-        nlohmann::json connection = {
-            {"Local", conn.local_address},
-            {"Remote", conn.remote_address},
-            {"State", conn.state}
-        };
-        results.push_back(connection);
+/*
+Records the beacon and fetches pending tasks in a single round trip,
+long-polling when LONG_POLL_SECONDS is set. Falls back to separate beacon()
+and pollServer() calls against servers that predate /api/agent/checkin.
+*/
+HttpResponse checkIn(ServerConnection& conn, int agentID){
+    if (!legacy_checkin) {
+        nlohmann::json checkinData;
+        checkinData["agent_id"] = agentID;
+        if (LONG_POLL_SECONDS > 0) checkinData["wait"] = LONG_POLL_SECONDS;
+
+        HttpResponse response = conn.request("POST", "/api/agent/checkin", checkinData.dump(), LONG_POLL_SECONDS * 1000);
+        if (response.status != 404 && response.status != 405) {
+            return response;
+        }
+        legacy_checkin = true;
     }
-    task_json["results"] = results;
 
-    return task_json;
+    beacon(conn, agentID);
+    return pollServer(conn, agentID);
 }
 
+/*
+END NETWORKING FUNCTIONS
 
+*/
 
 
 
 /*
-END NETSAT FUNCTIONS
+TASK FUNCTIONS
 */
 
+struct Task {
+    int task_id = 0;
+    int agent_id = 0;
+    string command;
+};
+
+// A command is a name optionally followed by space-separated arguments,
+// e.g. "netstat tcp6 udp6".
+string_view command_name(string_view command) {
+    return command.substr(0, command.find(' '));
+}
 
+string_view command_arguments(string_view command) {
+    size_t space = command.find(' ');
+    return space == string_view::npos ? string_view() : command.substr(space + 1);
+}
 
+// What a check-in reply says besides the task list.
+struct CheckinHints {
+    bool long_poll = false;  // the server held the request until a task came or its wait ran out
+    int next_checkin = 0;    // seconds until the server wants the next check-in, 0 if it has no say
+};
 
 /*
-PROCESS LIST FUNCTIONS
+SAX handler for the pending-tasks response, {"Tasks": [[task_id, agent_id,
+command, created_at], ...]}. Builds the Task list as the parser walks the
+text instead of materialising a DOM. Everything outside the "Tasks" array
+and every field past the command is skipped; a row whose fields have the
+wrong type is dropped. Top-level hints ("long_poll", "next_checkin") go to
+hints.
 */
+class TaskDecoder {
+public:
+    using json = nlohmann::json;
 
-vector<int> get_pids(){
-    vector<int> pids;
-    DIR* dir = opendir("/proc");
-    struct dirent* entry;
+    TaskDecoder(vector<Task>& tasks, CheckinHints& hints) : tasks(tasks), hints(hints) {}
 
-    if(dir == nullptr){
-        cerr << "Error opening /proc directory." << endl;
-        return pids;
+    bool null() { return field(Kind::Other); }
+    bool boolean(bool value) {
+        if (depth == 1 && long_poll_key) hints.long_poll = value;
+        return field(Kind::Other);
     }
+    bool number_float(json::number_float_t value, const json::string_t&) {
+        if (depth == 1 && next_checkin_key && value >= 0 && value <= INT_MAX) hints.next_checkin = static_cast<int>(value);
+        return field(Kind::Other);
+    }
+    bool binary(json::binary_t&) { return field(Kind::Other); }
 
-    while((entry = readdir(dir)) != nullptr){
-        if(entry->d_type == DT_DIR){
-            int pid = atoi(entry->d_name);
-            if(pid > 0){
-                pids.push_back(pid);
-            }
+    bool number_integer(json::number_integer_t value) { return integer(value); }
+    bool number_unsigned(json::number_unsigned_t value) {
+        return value <= static_cast<json::number_unsigned_t>(INT_MAX) ? integer(value) : field(Kind::Other);
+    }
+
+    bool string(json::string_t& value) {
+        if (in_task() && index == 2) task.command = std::move(value);
+        return field(Kind::String);
+    }
+
+    bool key(json::string_t& name) {
+        if (depth == 1) {
+            tasks_key = name == "Tasks";
+            long_poll_key = name == "long_poll";
+            next_checkin_key = name == "next_checkin";
         }
+        return true;
     }
 
-    closedir(dir);
-    return pids;
+    bool start_object(size_t) { return open(); }
+    bool end_object() { return close(); }
+
+    bool start_array(size_t) {
+        open();
+        if (depth == 2 && tasks_key) in_tasks = true;
+        else if (depth == 3 && in_tasks) {
+            task = Task();
+            index = 0;
+            valid = true;
+        }
+        return true;
+    }
+
+    bool end_array() {
+        if (depth == 3 && in_tasks && valid && index >= 3) tasks.push_back(std::move(task));
+        else if (depth == 2) in_tasks = false;
+        return close();
+    }
+
+    bool parse_error(size_t, const std::string&, const nlohmann::detail::exception&) { return false; }
+
+private:
+    enum class Kind { Integer, String, Other };
+
+    bool in_task() const { return in_tasks && depth == 3; }
+
+    bool integer(int64_t value) {
+        if (depth == 1 && next_checkin_key && value >= 0 && value <= INT_MAX) hints.next_checkin = static_cast<int>(value);
+        if (in_task() && index == 0) task.task_id = static_cast<int>(value);
+        if (in_task() && index == 1) task.agent_id = static_cast<int>(value);
+        return field(Kind::Integer);
+    }
+
+    // Checks the type of the value just read against its position in the row.
+    bool field(Kind kind) {
+        if (!in_task()) return true;
+        if ((index < 2 && kind != Kind::Integer) || (index == 2 && kind != Kind::String)) valid = false;
+        index++;
+        return true;
+    }
+
+    bool open() {
+        if (in_task()) field(Kind::Other);  // a nested container counts as one field
+        depth++;
+        return true;
+    }
+
+    bool close() {
+        depth--;
+        return true;
+    }
+
+    vector<Task>& tasks;
+    CheckinHints& hints;
+    Task task;
+    int depth = 0;
+    int index = 0;
+    bool tasks_key = false;
+    bool long_poll_key = false;
+    bool next_checkin_key = false;
+    bool in_tasks = false;
+    bool valid = false;
+};
+
+bool decode_tasks(string_view body, vector<Task>& tasks, CheckinHints& hints) {
+    TaskDecoder decoder(tasks, hints);
+    if (!nlohmann::json::sax_parse(body, &decoder)) {
+        tasks.clear();
+        return false;
+    }
+    return true;
 }
 
-string get_process_name(int pid){
-    ifstream status_file("/proc/" +to_string(pid) + "/status");
-    string line;
+// The pacing hint of a reply that carries no tasks to run, such as an error
+// status sent while the server sheds load. Never a long poll.
+CheckinHints decode_hints(string_view body) {
+    vector<Task> tasks;
+    CheckinHints hints;
+    decode_tasks(body, tasks, hints);
+    return CheckinHints{false, hints.next_checkin};
+}
 
-    while(getline(status_file, line)){
-        if(line.find("Name:") == 0){
-            return line.substr(6);
-        }
+// Writes the result of one task. The command must be one run_task knows.
+// Returns the seq of the snapshot the collector staged, 0 if it has none.
+uint32_t run_task(const Task& task, ResultWriter& out) {
+    string_view name = command_name(task.command);
+    if(name == "netstat"){
+        return netstat_list(task.task_id, task.agent_id, out, netstat_tables(command_arguments(task.command)));
     }
-    return "";
+    else if(name == "process_list"){
+        return ps_list(task.task_id, task.agent_id, out);
+    }
+    return 0;
 }
 
+// A finished task: its result object, encoded on its own so the uploader
+// can splice it into a batch.
+// Results that grow past this many bytes are moved out of memory into a
+// temporary file in RESULT_SPILL_DIR (see ResultBody); 0 keeps every result
+// in memory.
+size_t RESULT_SPILL_BYTES = 1024 * 1024;
+string RESULT_SPILL_DIR = "/tmp";
+
+/*
+The encoded bytes of one result. They are kept in memory until they pass
+RESULT_SPILL_BYTES and then move to an unlinked temporary file, which
+finish() maps read-only, so a result as big as a netstat of the whole host
+is read back as one string_view but never sits on the heap. A body whose
+file cannot be created stays in memory; one whose file cannot be written
+fails.
+*/
+class ResultBody {
+public:
+    ResultBody() = default;
+    ~ResultBody() { reset(); }
+
+    ResultBody(ResultBody&& other) noexcept { *this = std::move(other); }
+    ResultBody& operator=(ResultBody&& other) noexcept {
+        if (this != &other) {
+            reset();
+            memory = std::move(other.memory);
+            fd = std::exchange(other.fd, -1);
+            mapping = std::exchange(other.mapping, nullptr);
+            length = std::exchange(other.length, 0);
+            in_memory = std::exchange(other.in_memory, false);
+            failed = std::exchange(other.failed, false);
+        }
+        return *this;
+    }
+
+    // Returns false once the body has failed.
+    bool append(string_view data);
+    // Called after the last append() and before view(). Returns false if
+    // the body failed and is not to be used.
+    bool finish();
+
+    string_view view() const { return fd >= 0 ? string_view(mapping, length) : string_view(memory); }
+    // Bytes held on the heap, what counts against RESULT_QUEUE_BYTES.
+    size_t memory_size() const { return memory.size(); }
+
+private:
+    bool spill();
+    void reset();
+
+    string memory;
+    int fd = -1;
+    char* mapping = nullptr;
+    size_t length = 0;  // bytes in the file
+    bool in_memory = false;  // spill() failed, so it is not tried again
+    bool failed = false;
+};
 
-nlohmann::json ps_list(int task_id, int agent_id){
-    //json building
-    nlohmann::json task_json;
-    task_json["task_id"] = task_id;
-    task_json["agent_id"] = agent_id;
-    task_json["command"] = "process_list";
+bool ResultBody::append(string_view data) {
+    if (failed) return false;
+    if (fd < 0 && (RESULT_SPILL_BYTES == 0 || memory.size() + data.size() <= RESULT_SPILL_BYTES || in_memory || !spill())) {
+        memory.append(data.data(), data.length());
+        return true;
+    }
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.length());
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            cerr << "Writing result to " << RESULT_SPILL_DIR << " failed: " << strerror(errno) << endl;
+            failed = true;
+            return false;
+        }
+        data.remove_prefix(written);
+        length += written;
+    }
+    return true;
+}
 
-    std::vector<int> pids = get_pids();
-    nlohmann::json results = nlohmann::json::array();
+// Moves what is in memory to a new unlinked file. False, with nothing
+// changed, if the file cannot be made.
+bool ResultBody::spill() {
+    int file = open(RESULT_SPILL_DIR.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (file < 0) {
+        cerr << "Cannot spill result to " << RESULT_SPILL_DIR << ": " << strerror(errno) << endl;
+        in_memory = true;
+        return false;
+    }
+    fd = file;
+    string held = std::move(memory);
+    memory = string();
+    return append(held);
+}
 
-    for(int pid: pids){
-        string process_name = get_process_name(pid);
-        nlohmann::json proecss = {
-            {"PID", pid},
-            {"Name", process_name}
-        };
-        results.push_back(proecss);
+bool ResultBody::finish() {
+    if (failed || fd < 0 || mapping) return !failed;
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        cerr << "Mapping spilled result failed: " << strerror(errno) << endl;
+        failed = true;
+        return false;
     }
-    task_json["results"] = results;
-    //cout << task_json.dump(4) << endl;
-    return task_json;
+    mapping = static_cast<char*>(mapped);
+    return true;
+}
+
+void ResultBody::reset() {
+    if (mapping) munmap(mapping, length);
+    if (fd >= 0) ::close(fd);
+    memory.clear();
+    fd = -1;
+    mapping = nullptr;
+    length = 0;
+    in_memory = false;
+    failed = false;
 }
 
+struct TaskResult {
+    Task task;
+    ResultBody body;
+    ResultEncoding encoding = ResultEncoding::Json;
+    uint32_t snapshot_seq = 0;
+    size_t reserved = 0;  // bytes counted against RESULT_QUEUE_BYTES
+};
+
+// Recently uploaded task ids remembered by TaskLedger.
+size_t COMPLETED_TASK_MEMORY = 256;
 
 /*
-END PROCESS LIST FUNCTIONS
+Task ids this agent has taken on and not finished yet, and the last
+COMPLETED_TASK_MEMORY ids whose results the server stored. A task is listed
+on every check-in until its result is stored (and, on servers that lease
+tasks, again once the lease runs out), and a check-in can race the upload
+that stores it; the ledger keeps each of those from running twice. The in
+flight set stays small because a task only enters it once the engine has
+room for it.
 */
+class TaskLedger {
+public:
+    // False if the task is already running or was recently completed.
+    bool begin(int task_id) {
+        lock_guard<mutex> lock(ledger_lock);
+        if (find(completed.begin(), completed.end(), task_id) != completed.end()) return false;
+        return in_flight.insert(task_id).second;
+    }
+
+    // A task that was not stored is forgotten so a later delivery runs it.
+    void finish(int task_id, bool stored) {
+        lock_guard<mutex> lock(ledger_lock);
+        in_flight.erase(task_id);
+        if (!stored || COMPLETED_TASK_MEMORY == 0) return;
+        if (completed.size() < COMPLETED_TASK_MEMORY) {
+            completed.push_back(task_id);
+        } else {
+            completed[next_completed] = task_id;
+            next_completed = (next_completed + 1) % completed.size();
+        }
+    }
+
+private:
+    mutex ledger_lock;
+    unordered_set<int> in_flight;
+    vector<int> completed;  // ring, oldest at next_completed once full
+    size_t next_completed = 0;
+};
+
+TaskLedger task_ledger;
 
 /*
-NETWORKING FUNCTIONS
+END TASK FUNCTIONS
+*/
+
+// Set once the server turns out not to have the batch result endpoint.
+bool legacy_results = false;
+
+// Encoding for batched result uploads. A server that answers Cbor with 415
+// Unsupported Media Type gets Json from then on.
+atomic<ResultEncoding> RESULT_ENCODING{ResultEncoding::Json};
+
+// Set once the server has said it can take gzip-compressed uploads.
+atomic<bool> server_accepts_gzip{false};
+
+// Runs a task on the calling worker into a result of its own.
+TaskResult execute_task(Task task) {
+    TaskResult result;
+    result.encoding = RESULT_ENCODING;
+    ResultWriter out([&result](string_view data) {
+        return result.body.append(data);
+    }, result.encoding);
+    result.snapshot_seq = run_task(task, out);
+    out.flush();
+    result.task = std::move(task);
+    return result;
+}
 
+/*
+Re-encodes one Cbor item as Json token by token, without building a
+document. Reads what ResultWriter writes: maps and arrays (indefinite, or
+definite), text strings and integers. Returns false on anything else, on
+a map key that is not a string, or when the item is truncated or followed
+by more bytes.
 */
+static bool transcode_cbor(string_view cbor, ResultWriter& out) {
+    struct Container {
+        bool map;
+        bool indefinite;
+        uint64_t remaining;  // items left in a definite container
+        bool key_next;       // in a map: the next item is a key
+    };
+    vector<Container> open;
+    size_t i = 0;
+
+    auto argument = [&](uint8_t info, uint64_t& n) {
+        if (info < 24) {
+            n = info;
+            return true;
+        }
+        if (info > 27) return false;
+        size_t bytes = size_t(1) << (info - 24);
+        if (cbor.length() - i < bytes) return false;
+        n = 0;
+        for (size_t k = 0; k < bytes; k++) n = (n << 8) | static_cast<unsigned char>(cbor[i++]);
+        return true;
+    };
+    auto close = [&] {
+        if (open.back().map) out.end_object();
+        else out.end_array();
+        open.pop_back();
+    };
+    // An item is complete: a key moves its map on to the value, and a value
+    // may fill up a definite container, which completes that one in turn.
+    auto completed = [&] {
+        while (!open.empty()) {
+            Container& parent = open.back();
+            if (parent.map) {
+                parent.key_next = !parent.key_next;
+                if (!parent.key_next) return;
+            }
+            if (parent.indefinite || --parent.remaining > 0) return;
+            close();
+        }
+    };
+
+    do {
+        if (i >= cbor.length()) return false;
+        uint8_t initial = static_cast<uint8_t>(cbor[i++]);
+        uint8_t major = initial >> 5;
+        uint8_t info = initial & 0x1F;
+        bool as_key = !open.empty() && open.back().map && open.back().key_next;
+
+        if (initial == 0xFF) {  // "break"
+            if (open.empty() || !open.back().indefinite || (open.back().map && !as_key)) return false;
+            close();
+            completed();
+            continue;
+        }
+        if (as_key && major != 3) return false;
+
+        uint64_t n = 0;
+        if (major == 0 || major == 1) {
+            if (!argument(info, n) || n > static_cast<uint64_t>(INT64_MAX)) return false;
+            out.value(major == 0 ? static_cast<int64_t>(n) : -1 - static_cast<int64_t>(n));
+            completed();
+        } else if (major == 3) {
+            if (!argument(info, n) || n > cbor.length() - i) return false;
+            string_view text = cbor.substr(i, n);
+            i += n;
+            if (as_key) out.key(text);
+            else out.value(text);
+            completed();
+        } else if (major == 4 || major == 5) {
+            bool indefinite = info == 31;
+            if (!indefinite && !argument(info, n)) return false;
+            if (major == 5) out.begin_object();
+            else out.begin_array();
+            open.push_back({major == 5, indefinite, n, true});
+            if (!indefinite && n == 0) {
+                close();
+                completed();
+            }
+        } else {
+            return false;
+        }
+    } while (!open.empty());
+    return i == cbor.length();
+}
 
-int create_socket() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        cerr << "Error creating socket" << endl;
-        exit(1);
-    }
-    return sock;
+// Re-encodes a Cbor result for a server that only reads Json. False, with
+// the result left as it was, if it is not Cbor that ResultWriter wrote.
+bool convert_to_json(TaskResult& result) {
+    if (result.encoding == ResultEncoding::Json) return true;
+    ResultBody json;
+    ResultWriter out([&json](string_view data) {
+        return json.append(data);
+    });
+    if (!transcode_cbor(result.body.view(), out) || !out.flush() || !json.finish()) return false;
+    result.body = std::move(json);
+    result.encoding = ResultEncoding::Json;
+    return true;
 }
 
-sockaddr_in setup_server_address(const char* server_host, int server_port) {
-    sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    inet_pton(AF_INET, server_host, &server_address.sin_addr);
-    server_address.sin_port = htons(server_port);
-    return server_address;
+// Makes the snapshot a result carried the new delta base once the server
+// has stored it, or drops it when the upload failed.
+void settle_snapshot(const TaskResult& result, bool stored) {
+    if (result.snapshot_seq == 0) return;
+    string_view name = command_name(result.task.command);
+    if (name == "process_list") {
+        if (stored) process_deltas.commit(result.snapshot_seq);
+        else process_deltas.discard(result.snapshot_seq);
+    } else if (name == "netstat") {
+        if (stored) netstat_deltas.commit(result.snapshot_seq);
+        else netstat_deltas.discard(result.snapshot_seq);
+    }
 }
 
-void connect_to_server(int sock, sockaddr_in& server_address) {
-    if (connect(sock, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        cerr << "Error connecting to server" << endl;
-        exit(1);
+// Whether the server kept a result. Servers that lease tasks list the ids
+// they stored; older ones only name the commands they could not apply.
+static bool result_stored(const nlohmann::json& reply, const Task& task) {
+    auto stored = reply.find("stored");
+    if (stored != reply.end() && stored->is_array()) {
+        return find(stored->begin(), stored->end(), task.task_id) != stored->end();
     }
+    auto resync = reply.find("resync");
+    if (resync != reply.end() && resync->is_array()) {
+        return find(resync->begin(), resync->end(), string(command_name(task.command))) == resync->end();
+    }
+    return true;
 }
 
-void send_request(int sock, const char* request) {
-    if (send(sock, request, strlen(request), 0) < 0) {
-        cerr << "Error sending request" << endl;
-        exit(1);
+/*
+Once results are stored the snapshots they carried become the new delta
+bases and their tasks are done. The reply also says whether the server can
+rebuild results from deltas, and lists the commands whose delta it could
+not apply ("resync"); those tasks stay pending and are re-run as keyframes.
+*/
+void handle_results_response(const HttpResponse& response, const TaskResult* results, size_t count) {
+    bool accepted = response.status / 100 == 2;
+    nlohmann::json reply;
+    if (accepted) reply = nlohmann::json::parse(response.body, nullptr, false);
+    if (!reply.is_object()) reply = nlohmann::json::object();
+
+    for (size_t i = 0; i < count; i++) {
+        bool stored = accepted && result_stored(reply, results[i].task);
+        settle_snapshot(results[i], stored);
+        task_ledger.finish(results[i].task.task_id, stored);
+    }
+    if (!accepted) return;
+
+    if (reply.value("deltas", false)) server_accepts_deltas = true;
+    if (reply.value("columnar", false)) server_accepts_columnar = true;
+    if (reply.value("gzip", false)) server_accepts_gzip = true;
+    auto resync = reply.find("resync");
+    if (resync != reply.end() && resync->is_array()) {
+        for (const auto& command : *resync) {
+            if (command == "process_list") process_deltas.force_keyframe();
+            if (command == "netstat") netstat_deltas.force_keyframe();
+        }
     }
 }
 
-string receive_response(int sock) {
-    char buffer[4096];
-    ssize_t bytes_received;
-    string response_data;
-    while ((bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';  // null-terminate
-        response_data += buffer;
+// Converts every result to Json. One that cannot be converted is settled
+// as not stored and dropped, so the server hands its task out again.
+static void convert_results_to_json(vector<TaskResult>& results) {
+    size_t kept = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (convert_to_json(results[i])) {
+            if (kept != i) results[kept] = std::move(results[i]);
+            kept++;
+            continue;
+        }
+        cerr << "Dropping result of task " << results[i].task.task_id << ": not valid Cbor" << endl;
+        handle_results_response(HttpResponse(), &results[i], 1);
     }
-    return response_data;
+    results.resize(kept);
 }
 
-void send_post_request(int sock, const std::string& endpoint, const std::string& body) {
-    std::string request = "POST " + endpoint + " HTTP/1.1\r\n";
-    request += "Host: 127.0.0.1\r\n";
-    request += "Content-Type: application/json\r\n";
-    request += "Content-Length: " + std::to_string(body.length()) + "\r\n";
-    request += "\r\n";  // Headers end
-    request += body;    // Request body
+/*
+Uploads finished results as a single array. Each result is already encoded,
+so a replay after a dead connection or a switch of encoding only resends
+bytes and never runs a collector again. Returns false, with the results
+not yet answered left in place, when the server could not be reached.
+*/
+bool sendResults(vector<TaskResult>& results, ServerConnection& conn){
+    if (results.empty()) return true;
+
+    while (!legacy_results) {
+        // Results encoded before a switch to Json are converted with the rest.
+        ResultEncoding encoding = RESULT_ENCODING;
+        for (const auto& result : results) {
+            if (result.encoding != encoding) encoding = ResultEncoding::Json;
+        }
+        if (encoding == ResultEncoding::Json) {
+            convert_results_to_json(results);
+            if (results.empty()) return true;
+        }
 
-    if (send(sock, request.c_str(), request.length(), 0) < 0) {
-        cerr << "Error sending POST request" << endl;
-        exit(1);
+        HttpResponse response = conn.stream("/api/agent/task/send_results", encoding, [&](ResultWriter& out) {
+            out.begin_array();
+            for (const auto& result : results) {
+                out.encoded(result.body.view());
+            }
+            out.end_array();
+        }, server_accepts_gzip);
+        if (response.status == 0) return false;
+        if (response.status == 415 && encoding != ResultEncoding::Json) {
+            RESULT_ENCODING = ResultEncoding::Json;
+            continue;
+        }
+        if (response.status != 404 && response.status != 405) {
+            handle_results_response(response, results.data(), results.size());
+            cout << "Sent " << results.size() << " results" << endl;
+            results.clear();
+            return true;
+        }
+        legacy_results = true;
     }
-}
 
-string doPost(string body, sockaddr_in server_address){
-    int sock = create_socket();
-    connect_to_server(sock, server_address);
-    string endpoint = "api/agent/task/send_result";
-    send_post_request(sock, endpoint, body);
-    string response = receive_response(sock);
-    close(sock);
-    cout << "Sent paylod" << endl;
-    return response;
+    convert_results_to_json(results);
+    while (!results.empty()) {
+        TaskResult& result = results.front();
+        HttpResponse response = conn.stream("/api/agent/task/send_result", ResultEncoding::Json, [&](ResultWriter& out) {
+            out.encoded(result.body.view());
+        }, server_accepts_gzip);
+        if (response.status == 0) return false;
+        handle_results_response(response, &result, 1);
+        results.erase(results.begin());
+        cout << "Sent paylod" << endl;
+    }
+    return true;
 }
 
-int newAgent(sockaddr_in server_address, string ip, string mac){
-    nlohmann::json newAgentData;
-    newAgentData["ip"] = ip;
-    newAgentData["mac"] = mac;
 
-    string body = newAgentData.dump();  
-    
-    int sock = create_socket();
-    connect_to_server(sock, server_address);
-    string endpoint = "/api/new_agent";
-    send_post_request(sock, endpoint, body);
-    string response = receive_response(sock);
-    close(sock);
-    
 
-    size_t json_start_pos = response.find("{");
-    if (json_start_pos != std::string::npos) {
-        std::string json_content = response.substr(json_start_pos);
-        try {
-            nlohmann::json jsonResponse = nlohmann::json::parse(json_content);
-            int agentID = jsonResponse["id"];
-            return agentID;
-        } catch (const std::exception& e) {
-            std::cerr << "Error parsing JSON: " << e.what() << std::endl;
-            return -1;
+/*
+TASK ENGINE FUNCTIONS
+*/
+
+// Collectors that may run at once.
+int TASK_WORKERS = 2;
+// Tasks that may wait for a worker, and finished results that may wait for
+// the uploader, before submit() and the workers push back.
+size_t TASK_QUEUE_CAPACITY = 64;
+size_t RESULT_QUEUE_CAPACITY = 64;
+// Encoded results that may be held in memory between the workers and the
+// end of their upload, in bytes; results spilled to a file (see
+// RESULT_SPILL_BYTES) do not count. A worker whose result does not fit
+// waits until nothing else is held. Peak memory is this plus RESULT_SPILL_BYTES per worker being
+// written.
+size_t RESULT_QUEUE_BYTES = 16 * 1024 * 1024;
+
+/*
+Bounded multi-producer multi-consumer ring after Dmitry Vyukov's design.
+Every cell carries a sequence number that tells a producer or consumer
+whether the cell is ready for the lap it is on, so a push or pop is one
+compare-and-swap on the tail or head index and never takes a lock.
+*/
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        cells = make_unique<Cell[]>(size);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    // Moves value in, or leaves it untouched and returns false when full.
+    bool try_push(T& value) {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lap = static_cast<intptr_t>(sequence - position);
+            if (lap == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            } else if (lap < 0) {
+                return false;
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
         }
-    } else {
-        std::cerr << "Could not find the start of the JSON content." << std::endl;
-        return -1;
     }
-}
 
-string pollServer(sockaddr_in server_address, int agentID){
-    int sock = create_socket();
-    connect_to_server(sock, server_address);
+    bool try_pop(T& value) {
+        size_t position = head.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lap = static_cast<intptr_t>(sequence - (position + 1));
+            if (lap == 0) {
+                if (head.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (lap < 0) {
+                return false;
+            } else {
+                position = head.load(memory_order_relaxed);
+            }
+        }
+    }
 
-    std::string requestStr = "GET /api/agent/tasks/pending/" + std::to_string(agentID) + " HTTP/1.1\r\nHOST: localhost\r\nConnection: close\r\n\r\n";
-    const char* request = requestStr.c_str();
-    send_request(sock, request);
+private:
+    struct alignas(64) Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
 
-    string response_data = receive_response(sock);
-    //cout << "Received Data: \n" << response_data << endl;
-    close(sock);
-    return response_data;
-}
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};
+    alignas(64) atomic<size_t> head{0};
+};
 
-void beacon(sockaddr_in server_address, int agentID){
-    nlohmann::json beaconData;
-    beaconData["agent_id"] = agentID;
+/*
+Lets a thread sleep until another one has queued something for it; the
+queues themselves never block. A waiter reads generation() before it looks
+at its queue and waits on that, so a ring() in between is not missed.
+*/
+class Doorbell {
+public:
+    uint64_t generation() const { return rings.load(memory_order_acquire); }
+
+    void ring() {
+        {
+            lock_guard<mutex> lock(waiting);
+            rings.fetch_add(1, memory_order_release);
+        }
+        rung.notify_all();
+    }
 
-    string body = beaconData.dump();  
-    
-    int sock = create_socket();
-    connect_to_server(sock, server_address);
-    string endpoint = "/api/beacon";
-    send_post_request(sock, endpoint, body);
-    string response = receive_response(sock);
-    close(sock);
-}
+    void wait(uint64_t seen) {
+        unique_lock<mutex> lock(waiting);
+        rung.wait(lock, [&] { return rings.load(memory_order_acquire) != seen; });
+    }
 
-/*
-END NETWORKING FUNCTIONS
+private:
+    atomic<uint64_t> rings{0};
+    mutex waiting;
+    condition_variable rung;
+};
 
+/*
+Runs tasks on a fixed pool of worker threads, so a slow collector holds up
+neither the other tasks nor the check-in loop. submit() only queues a task.
+Each worker encodes its result on its own and passes it to the uploader
+thread through a lock-free queue; the uploader sends whatever has finished
+as one batch over a connection of its own. While the server is unreachable
+the uploader holds on to the batch and retries it, and the workers stall
+once the result queue is full or RESULT_QUEUE_BYTES are held.
 */
+class TaskEngine {
+public:
+    explicit TaskEngine(const sockaddr_in& server_address, int worker_count = TASK_WORKERS);
+    ~TaskEngine();
+
+    TaskEngine(const TaskEngine&) = delete;
+    TaskEngine& operator=(const TaskEngine&) = delete;
+
+    // Queues the task for a worker. Returns false, leaving task untouched,
+    // when TASK_QUEUE_CAPACITY tasks are already waiting.
+    bool submit(Task& task);
+
+    // Blocks until every submitted task has been run and uploaded.
+    void wait_idle();
+
+private:
+    void work();
+    void upload();
+    void reserve_bytes(size_t size);
+    void release_bytes(size_t size);
+
+    BoundedQueue<Task> tasks;
+    BoundedQueue<TaskResult> results;
+    Doorbell task_queued;
+    Doorbell result_queued;
+    Doorbell result_taken;
+    Doorbell task_done;
+    ServerConnection conn;
+    atomic<size_t> outstanding{0};  // submitted, not yet uploaded
+    atomic<size_t> held_bytes{0};   // results queued or in the uploader's batch
+    atomic<bool> stopping{false};
+    atomic<bool> workers_done{false};
+    vector<thread> workers;
+    thread uploader;
+};
+
+TaskEngine::TaskEngine(const sockaddr_in& server_address, int worker_count)
+    : tasks(TASK_QUEUE_CAPACITY), results(RESULT_QUEUE_CAPACITY), conn(server_address) {
+    for (int i = 0; i < max(worker_count, 1); i++) {
+        workers.emplace_back(&TaskEngine::work, this);
+    }
+    uploader = thread(&TaskEngine::upload, this);
+}
+
+// Runs and uploads whatever is still queued before the threads exit.
+TaskEngine::~TaskEngine() {
+    stopping = true;
+    task_queued.ring();
+    for (auto& worker : workers) worker.join();
+    workers_done = true;
+    result_queued.ring();
+    uploader.join();
+}
 
+bool TaskEngine::submit(Task& task) {
+    outstanding++;
+    if (!tasks.try_push(task)) {
+        outstanding--;
+        task_done.ring();
+        return false;
+    }
+    task_queued.ring();
+    return true;
+}
+
+void TaskEngine::wait_idle() {
+    while (true) {
+        uint64_t seen = task_done.generation();
+        if (outstanding == 0) return;
+        task_done.wait(seen);
+    }
+}
 
+void TaskEngine::work() {
+    while (true) {
+        uint64_t seen = task_queued.generation();
+        Task task;
+        if (!tasks.try_pop(task)) {
+            if (stopping) return;
+            task_queued.wait(seen);
+            continue;
+        }
 
-void parse_tasks(const string& response_data, sockaddr_in server_address) {
-    size_t json_start_pos = response_data.find("{");
-    if (json_start_pos != std::string::npos) {
-        std::string json_content = response_data.substr(json_start_pos);
+        TaskResult result = execute_task(std::move(task));
+        if (!result.body.finish()) {
+            // Left to the server to hand out again.
+            handle_results_response(HttpResponse(), &result, 1);
+            outstanding--;
+            task_done.ring();
+            continue;
+        }
+        result.reserved = result.body.memory_size();
+        reserve_bytes(result.reserved);
+        while (true) {
+            uint64_t taken = result_taken.generation();
+            if (results.try_push(result)) break;
+            result_taken.wait(taken);
+        }
+        result_queued.ring();
+    }
+}
 
-        try {
-            nlohmann::json j = nlohmann::json::parse(json_content);
+// Waits until size more bytes of results fit in RESULT_QUEUE_BYTES.
+void TaskEngine::reserve_bytes(size_t size) {
+    while (true) {
+        uint64_t taken = result_taken.generation();
+        size_t held = held_bytes.load();
+        while (held == 0 || held + size <= RESULT_QUEUE_BYTES) {
+            if (held_bytes.compare_exchange_weak(held, held + size)) return;
+        }
+        result_taken.wait(taken);
+    }
+}
 
-            // Access data (assuming the JSON structure is known)
-            auto tasks = j["Tasks"];
-            for (const auto& task : tasks) {
-                int task_id = task[0];
-                int agent_id = task[1];
-                string command = task[2];
-                string timestamp = task[3];
+void TaskEngine::release_bytes(size_t size) {
+    if (size == 0) return;
+    held_bytes -= size;
+    result_taken.ring();
+}
 
-                
-                //cout << "Task ID: " << task_id << ", Agent ID: " << agent_id 
-                 //    << ", Task Name: " << command << ", Timestamp: " << timestamp << endl;
+static size_t reserved_bytes(const vector<TaskResult>& results) {
+    size_t total = 0;
+    for (const TaskResult& result : results) total += result.reserved;
+    return total;
+}
 
+void TaskEngine::upload() {
+    vector<TaskResult> batch;
+    while (true) {
+        uint64_t seen = result_queued.generation();
+        TaskResult result;
+        while (batch.size() < RESULT_QUEUE_CAPACITY && results.try_pop(result)) {
+            batch.push_back(std::move(result));
+        }
+        if (batch.empty()) {
+            if (workers_done) return;
+            result_queued.wait(seen);
+            continue;
+        }
 
-                if(command == "netstat"){
-                    nlohmann::json netstatJson = netstat_list(task_id, agent_id);
-                    string response = doPost(netstatJson.dump(), server_address);
-                }
-                else if(command == "process_list"){
-                    nlohmann::json psJson = ps_list(task_id, agent_id);
-                    string response = doPost(psJson.dump(), server_address);
-                }
-                else {
-                    cout << "No method for this task." <<endl;
-                }
+        result_taken.ring();
+        size_t count = batch.size();
+        size_t bytes = reserved_bytes(batch);
+        bool sent = sendResults(batch, conn);
+        outstanding -= count - batch.size();
+        release_bytes(bytes - reserved_bytes(batch));
+        if (!sent) {
+            if (!workers_done) {
+                // Keep what the server has not answered and try again later,
+                // with whatever finishes in the meantime.
+                this_thread::sleep_for(retry_backoff(REQUEST_ATTEMPTS));
+                continue;
             }
+            // Shutting down: the tasks are left to the server to hand out again.
+            handle_results_response(HttpResponse(), batch.data(), batch.size());
+            outstanding -= batch.size();
+            release_bytes(reserved_bytes(batch));
+            batch.clear();
+        }
+        task_done.ring();
+    }
+}
+
+/*
+END TASK ENGINE FUNCTIONS
+*/
+
+// Picks the tasks we have a method for out of the response and hands them
+// to the workers, skipping any the ledger says are running or done; their
+// results are uploaded as they finish. Returns the reply's other hints.
+CheckinHints parse_tasks(string_view response_body, TaskEngine& engine) {
+    vector<Task> tasks;
+    CheckinHints hints;
+    if (!decode_tasks(response_body, tasks, hints)) {
+        std::cerr << "Error parsing tasks JSON" << std::endl;
+        return CheckinHints();
+    }
 
-        } catch (const std::exception& e) {
-            std::cerr << "Error parsing JSON: " << e.what() << std::endl;
+    for (auto& task : tasks) {
+        string_view name = command_name(task.command);
+        if (name != "netstat" && name != "process_list") {
+            cout << "No method for this task." << endl;
+            continue;
+        }
+        int task_id = task.task_id;
+        if (!task_ledger.begin(task_id)) continue;  // already running or done
+        if (!engine.submit(task)) {
+            // still pending on the server, which hands it out again once
+            // its lease runs out
+            task_ledger.finish(task_id, false);
+            cout << "Task queue full, leaving task " << task_id << " for later" << endl;
         }
-    } else {
-        std::cerr << "Could not find the start of the JSON content." << std::endl;
     }
+    return hints;
 }
 
 
 
+
+// bench.cpp compiles this file in with EZC2_NO_MAIN to reach the collectors.
+#ifndef EZC2_NO_MAIN
 int main() {
 
     //Server Connection stuff
     const char* server_host = "127.0.0.1";
     const int server_port = 5000;
     sockaddr_in server_address = setup_server_address(server_host, server_port);
-    int agentID = newAgent(server_address, "127.0.0.1", "00:00:00:00:00:00");
+    ServerConnection conn(server_address);
+    int agentID = newAgent(conn, "127.0.0.1", "00:00:00:00:00:00");
 
     agentID = 2; //override for testing
   
-    
+    TaskEngine engine(server_address);
+    auto next_checkin = chrono::steady_clock::now();
     while(true) {
 
-        //beacon
-        beacon(server_address, agentID);
-        //get tasks from server
-        string response_data = pollServer(server_address, agentID);
-        //parse tasks Json and send POST responses
-        parse_tasks(response_data, server_address);
+        //beacon and get tasks from server
+        HttpResponse response = checkIn(conn, agentID);
+        //queue the tasks; the engine runs them and sends the results
+        CheckinHints hints;
+        if (response.status == 200) {
+            hints = parse_tasks(response.body, engine);
+        } else if (response.status != 0) {
+            hints = decode_hints(response.body);
+        }
 
-        this_thread::sleep_for(std::chrono::seconds(BEACON_FREQUENCY));
+        // A long poll already waited on the server's side, so the next one
+        // goes out at once. Otherwise tasks run in the background, so
+        // check-ins keep a fixed cadence instead of drifting by however
+        // long the cycle took, and the server may pick the interval within
+        // our bounds.
+        if (hints.long_poll) {
+            next_checkin = chrono::steady_clock::now();
+            continue;
+        }
+        int interval = BEACON_FREQUENCY;
+        if (hints.next_checkin > 0) {
+            interval = clamp(hints.next_checkin, CHECKIN_MIN_SECONDS, CHECKIN_MAX_SECONDS);
+        }
+        next_checkin = max(next_checkin + chrono::seconds(interval), chrono::steady_clock::now());
+        this_thread::sleep_until(next_checkin);
     }    
     
 
 
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,138 @@
+/*
+Synthetic inputs shared by client_bench and proc_fixture: socket rows, the
+text of /proc/net socket tables and whole /proc-shaped trees. Everything is
+generated from a fixed seed, so the same arguments give the same bytes.
+Include after client.cpp.
+*/
+
+#pragma once
+
+#include <ftw.h>
+#include <random>
+#include <sys/stat.h>
+
+// Process names with the spaces, slashes and parentheses real ones have.
+static const char* const FIXTURE_PROCESS_NAMES[] = {"bash", "sshd", "nginx: worker", "python3", "kworker/0:1-events",
+                                                    "(sd-pam)", "Web Content", "postgres", "systemd-journal", "a) b"};
+
+// Sockets with random addresses, ports and inodes in every TCP state.
+static vector<Connection> fixture_connections(size_t count, uint8_t family = AF_INET,
+                                              uint8_t protocol = IPPROTO_TCP, uint64_t seed = 42) {
+    mt19937_64 rng(seed);
+    vector<Connection> rows(count);
+    for (Connection& row : rows) {
+        row = {};
+        row.family = family;
+        row.protocol = protocol;
+        uint64_t words[4] = {rng(), rng(), rng(), rng()};
+        memcpy(row.local_address, words, 16);
+        memcpy(row.remote_address, words + 2, 16);
+        row.local_port = rng();
+        row.remote_port = rng();
+        row.state = static_cast<TcpState>(1 + rng() % 11);
+        row.inode = rng() % 10000000;
+    }
+    return rows;
+}
+
+// A process list of pids 1..count, named and timed like write_proc_tree's.
+[[maybe_unused]] static ProcessSnapshot fixture_processes(size_t count, uint64_t seed = 42) {
+    mt19937_64 rng(seed);
+    ProcessSnapshot snapshot;
+    for (size_t pid = 1; pid <= count; pid++) {
+        const char* name = FIXTURE_PROCESS_NAMES[rng() % size(FIXTURE_PROCESS_NAMES)];
+        snapshot.add(static_cast<int>(pid), 100 + pid * 7 + rng() % 7, name);
+    }
+    snapshot.build_index();
+    return snapshot;
+}
+
+// The text of a /proc/net/{tcp,tcp6,udp,udp6} table holding rows, header
+// included. IPv4 rows are padded like the kernel pads them.
+static string fixture_socket_table(const vector<Connection>& rows) {
+    string table = "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n";
+    char line[256];
+    for (size_t i = 0; i < rows.size(); i++) {
+        const Connection& row = rows[i];
+        char local[33], remote[33];
+        for (int word = 0; word < (row.family == AF_INET6 ? 4 : 1); word++) {
+            uint32_t l, r;
+            memcpy(&l, row.local_address + 4 * word, 4);
+            memcpy(&r, row.remote_address + 4 * word, 4);
+            snprintf(local + 8 * word, 9, "%08X", l);
+            snprintf(remote + 8 * word, 9, "%08X", r);
+        }
+        int length = snprintf(line, sizeof(line),
+                              "%4zu: %s:%04X %s:%04X %02X 00000000:00000000 00:00000000 00000000 %5u %8d %llu 1 0000000000000000 100 0 0 10 0",
+                              i, local, row.local_port, remote, row.remote_port, static_cast<unsigned>(row.state),
+                              i % 3 == 0 ? 0u : 1000u, 0, static_cast<unsigned long long>(row.inode));
+        table.append(line, length);
+        int width = row.protocol == IPPROTO_UDP ? 127 : 149;
+        if (row.family == AF_INET && length < width) table.append(width - length, ' ');
+        table += '\n';
+    }
+    return table;
+}
+
+static bool write_fixture_file(const string& path, string_view data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    while (ok && !data.empty()) {
+        ssize_t n = write(fd, data.data(), data.length());
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) data.remove_prefix(n);
+    }
+    return close(fd) == 0 && ok;
+}
+
+/*
+Writes a /proc-shaped tree under root (created if missing) for PROC_ROOT:
+pids process directories 1..pids, each with comm and stat, and socket_rows
+rows spread over net/tcp, tcp6, udp and udp6 (half, a quarter and an
+eighth each). A few names have the spaces and parentheses real ones do.
+*/
+[[maybe_unused]] static bool write_proc_tree(const string& root, size_t pids, size_t socket_rows, uint64_t seed = 42) {
+    mt19937_64 rng(seed);
+
+    mkdir(root.c_str(), 0755);
+    if (mkdir((root + "/net").c_str(), 0755) < 0 && errno != EEXIST) return false;
+    // Not processes; the scanner has to skip these.
+    if (!write_fixture_file(root + "/version", "Linux version 6.0.0 (fixture)\n")) return false;
+    mkdir((root + "/sys").c_str(), 0755);
+
+    string dir, stat;
+    for (size_t pid = 1; pid <= pids; pid++) {
+        dir = root + "/" + to_string(pid);
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return false;
+        const char* name = FIXTURE_PROCESS_NAMES[rng() % size(FIXTURE_PROCESS_NAMES)];
+        unsigned long long start_time = 100 + pid * 7 + rng() % 7;
+
+        char line[512];
+        int length = snprintf(line, sizeof(line),
+                              "%zu (%s) S %zu %zu %zu 0 -1 4194560 %llu 0 0 0 %llu %llu 0 0 20 0 1 0 %llu 17825792 640 "
+                              "18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 0 17 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+                              pid, name, pid > 1 ? pid / 2 : 0, pid, pid, static_cast<unsigned long long>(rng() % 5000),
+                              static_cast<unsigned long long>(rng() % 1000), static_cast<unsigned long long>(rng() % 1000),
+                              start_time);
+        stat.assign(line, length);
+        if (!write_fixture_file(dir + "/stat", stat) || !write_fixture_file(dir + "/comm", string(name) + "\n")) {
+            return false;
+        }
+    }
+
+    size_t shares[4] = {socket_rows / 2, socket_rows / 4, socket_rows / 8, 0};
+    shares[3] = socket_rows - shares[0] - shares[1] - shares[2];
+    for (size_t table = 0; table < SOCKET_TABLES.size(); table++) {
+        const SocketTable& spec = SOCKET_TABLES[table];
+        vector<Connection> rows = fixture_connections(shares[table], spec.family, spec.protocol, seed + table);
+        if (!write_fixture_file(root + "/" + spec.path, fixture_socket_table(rows))) return false;
+    }
+    return true;
+}
+
+[[maybe_unused]] static bool remove_proc_tree(const string& root) {
+    auto remove_entry = [](const char* path, const struct stat*, int, FTW*) { return remove(path); };
+    return nftw(root.c_str(), remove_entry, 64, FTW_DEPTH | FTW_PHYS) == 0;
+}
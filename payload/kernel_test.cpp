@@ -0,0 +1,130 @@
+/*
+Checks every socket table kernel set this CPU can run against the scalar
+one:
+
+    kernel_test [mutated lines]
+
+Fixture tables for tcp, tcp6, udp and udp6 must parse to the rows they
+were written from under every set. Then lines from those tables are
+randomly mutated (digits, separators, spacing and length) and every set
+has to accept or reject each the same way and, when it accepts, produce
+the same row. Exits non-zero on the first few mismatches, after printing
+them.
+*/
+
+#define EZC2_NO_MAIN
+#include "client.cpp"
+#include "fixtures.h"
+
+#include <cstdio>
+#include <random>
+
+using namespace std;
+
+static int failures = 0;
+constexpr int FAILURES_SHOWN = 10;
+
+static bool same_row(const Connection& a, const Connection& b) {
+    size_t address_length = a.family == AF_INET6 ? 16 : 4;
+    return a.family == b.family && memcmp(a.local_address, b.local_address, address_length) == 0 &&
+           memcmp(a.remote_address, b.remote_address, address_length) == 0 && a.local_port == b.local_port &&
+           a.remote_port == b.remote_port && a.state == b.state && a.inode == b.inode;
+}
+
+static void fail(const char* what, const TableKernels& set, string_view line) {
+    if (failures++ < FAILURES_SHOWN) {
+        printf("%s differs under %s: \"%.*s\"\n", what, set.name, static_cast<int>(line.length()), line.data());
+    }
+}
+
+// Parses line under set. The line is copied to a buffer of exactly its
+// length so a sanitizer build catches reads past the end.
+static bool parse_line(const TableKernels& set, bool ipv6, string_view line, Connection& row) {
+    unique_ptr<char[]> buffer(new char[line.length()]);
+    memcpy(buffer.get(), line.data(), line.length());
+    table_kernels = &set;
+    const char* end = buffer.get() + line.length();
+    return ipv6 ? parse_socket_row<4>(buffer.get(), end, row) : parse_socket_row<1>(buffer.get(), end, row);
+}
+
+static vector<string_view> table_lines(const string& table) {
+    vector<string_view> lines;
+    size_t p = table.find('\n') + 1;
+    while (p < table.size()) {
+        size_t newline = table.find('\n', p);
+        lines.push_back(string_view(table).substr(p, newline - p));
+        p = newline + 1;
+    }
+    return lines;
+}
+
+// Every line parses to the row it was written from.
+static void check_fixture_table(const vector<const TableKernels*>& kernels, const SocketTable& spec, size_t rows) {
+    vector<Connection> expected = fixture_connections(rows, spec.family, spec.protocol);
+    string table = fixture_socket_table(expected);
+    vector<string_view> lines = table_lines(table);
+    bool ipv6 = spec.family == AF_INET6;
+    for (const TableKernels* set : kernels) {
+        for (size_t i = 0; i < lines.size(); i++) {
+            Connection row;
+            if (!parse_line(*set, ipv6, lines[i], row) || !same_row(row, expected[i])) fail(spec.path, *set, lines[i]);
+        }
+    }
+}
+
+// Mutated lines are accepted or rejected alike, with the same rows.
+static void check_mutated_lines(const vector<const TableKernels*>& kernels, size_t count, uint64_t seed = 7) {
+    static const char ALPHABET[] = "0123456789ABCDEFabcdefgG: \t-x\n";
+    mt19937_64 rng(seed);
+    vector<string> tables[2];
+    for (const SocketTable& spec : SOCKET_TABLES) {
+        tables[spec.family == AF_INET6].push_back(fixture_socket_table(fixture_connections(64, spec.family, spec.protocol, rng())));
+    }
+
+    string line;
+    for (size_t i = 0; i < count; i++) {
+        bool ipv6 = rng() % 2;
+        const vector<string>& family = tables[ipv6];
+        vector<string_view> lines = table_lines(family[rng() % family.size()]);
+        line = lines[rng() % lines.size()];
+        int edits = 1 + rng() % 3;
+        for (int edit = 0; edit < edits && !line.empty(); edit++) {
+            size_t at = rng() % line.size();
+            switch (rng() % 4) {
+                case 0:
+                case 1: line[at] = ALPHABET[rng() % (sizeof(ALPHABET) - 1)]; break;
+                case 2: line.erase(at, 1 + rng() % 4); break;
+                case 3: line.resize(at); break;
+            }
+        }
+
+        Connection expected;
+        bool accepted = parse_line(SCALAR_TABLE_KERNELS, ipv6, line, expected);
+        for (const TableKernels* set : kernels) {
+            Connection row;
+            bool ok = parse_line(*set, ipv6, line, row);
+            if (ok != accepted || (ok && !same_row(row, expected))) fail("mutated line", *set, line);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t mutated = argc > 1 ? strtoull(argv[1], nullptr, 10) : 300000;
+
+    vector<const TableKernels*> kernels = {&SCALAR_TABLE_KERNELS};
+#if defined(__x86_64__)
+    kernels.push_back(&SSE2_TABLE_KERNELS);
+    if (__builtin_cpu_supports("avx2")) kernels.push_back(&AVX2_TABLE_KERNELS);
+#endif
+    for (const TableKernels* set : kernels) printf("kernel set %s\n", set->name);
+
+    for (const SocketTable& spec : SOCKET_TABLES) check_fixture_table(kernels, spec, 10000);
+    check_mutated_lines(kernels, mutated);
+
+    if (failures > 0) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    printf("all kernel sets agree on the fixture tables and %zu mutated lines\n", mutated);
+    return 0;
+}
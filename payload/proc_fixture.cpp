@@ -0,0 +1,28 @@
+/*
+Writes a synthetic /proc-shaped tree for benchmarking the collectors on
+fixed input:
+
+    proc_fixture <dir> <pids> <socket rows> [seed]
+
+Point the agent's PROC_ROOT (or client_bench's BENCH_PROC_ROOT) at <dir>.
+*/
+
+#define EZC2_NO_MAIN
+#include "client.cpp"
+#include "fixtures.h"
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " <dir> <pids> <socket rows> [seed]" << endl;
+        return 2;
+    }
+    size_t pids = strtoull(argv[2], nullptr, 10);
+    size_t socket_rows = strtoull(argv[3], nullptr, 10);
+    uint64_t seed = argc > 4 ? strtoull(argv[4], nullptr, 10) : 42;
+
+    if (!write_proc_tree(argv[1], pids, socket_rows, seed)) {
+        cerr << "Error writing " << argv[1] << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    return 0;
+}